@@ -2,7 +2,8 @@
 #define AUTH_MANAGER_H
 
 #include "../core/btree.h"
-#include "../core/hash_table.h"
+#include "../core/concurrent_hash_map.h"
+#include <fstream>
 #include <string>
 #include <cstring>
 #include <stdexcept>
@@ -77,13 +78,13 @@ class AuthManager {
 private:
     BTree<uint32_t, uint64_t>* authIndex;
 
-    HashTable<string, uint32_t>* usernameLookup;
+    ConcurrentHashMap<string, uint32_t>* usernameLookup;
 
     fstream authFile;
     const string AUTH_FILE = "auth.dat";
     const string AUTH_INDEX_FILE = "auth_index.dat";
 
-    HashTable<uint32_t, Session>* activeSessions;
+    ConcurrentHashMap<uint32_t, Session>* activeSessions;
 
     uint32_t nextUserID;
 
@@ -132,8 +133,8 @@ private:
 public:
     AuthManager() : nextUserID(1) {
         authIndex = new BTree<uint32_t, uint64_t>(AUTH_INDEX_FILE);
-        usernameLookup = new HashTable<string, uint32_t>(1009);
-        activeSessions = new HashTable<uint32_t, Session>(1009);
+        usernameLookup = new ConcurrentHashMap<string, uint32_t>(1009);
+        activeSessions = new ConcurrentHashMap<uint32_t, Session>(1009);
 
         authFile.open(AUTH_FILE, ios::in | ios::out | ios::binary);
         if (!authFile.is_open()) {
@@ -142,10 +143,9 @@ public:
             authFile.open(AUTH_FILE, ios::in | ios::out | ios::binary);
         }
 
-        vector<pair<uint32_t, uint64_t>> allRecords = authIndex->getAllPairs();
-        for (const auto& pair : allRecords) {
+        for (auto it = authIndex->begin(); it != authIndex->end(); ++it) {
             try {
-                AuthRecord record = loadAuthRecord(pair.first);
+                AuthRecord record = loadAuthRecord(it.key());
                 usernameLookup->insert(string(record.username), record.userID);
 
                 if (record.userID >= nextUserID) {
@@ -223,11 +223,9 @@ public:
     }
 
     void logout(uint32_t userID) {
-        Session session;
-        if (activeSessions->find(userID, session)) {
+        activeSessions->modify(userID, [](Session& session) {
             session.isActive = false;
-            activeSessions->insert(userID, session);
-        }
+        });
     }
 
     bool isLoggedIn(uint32_t userID) {
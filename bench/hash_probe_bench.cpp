@@ -0,0 +1,165 @@
+// Probe lengths and lookup cost of HashTable under the hashes it used
+// before hash policies (identity for integers, a base-31 polynomial for
+// strings, each scrambled by a Fibonacci multiply) and under the current
+// HashPolicy (murmur3 finalizer, wyhash-style strings).
+//
+// Key sets are sequential IDs, ml-100k (user, movie) rating keys as
+// EdgeStore packs them, 4 KB-aligned offsets as BTree keys its node
+// latches, ml-100k movie titles, and usernames as the parser generates
+// them. Run from the repository root, or pass the ml-100k directory.
+//
+//   g++ -O2 -std=c++17 bench/hash_probe_bench.cpp -o hash_probe_bench
+
+#include "../core/hash_table.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+const uint64_t FIBONACCI = 11400714819323198485ull;
+const size_t LOOKUP_ROUNDS = 20;
+
+struct OldIntegerHash {
+    uint64_t operator()(uint64_t key) const {
+        return key * FIBONACCI;
+    }
+};
+
+struct OldStringHash {
+    uint64_t operator()(string_view key) const {
+        uint64_t hash = 0;
+        for (size_t i = 0; i < key.size(); i++) {
+            hash = hash * 31 + static_cast<unsigned char>(key[i]);
+        }
+        return hash * FIBONACCI;
+    }
+};
+
+struct ProbeStats {
+    double mean;
+    size_t longest;
+    double home;
+    double lookupNs;
+};
+
+template<typename K, typename H>
+ProbeStats measure(const vector<K>& keys) {
+    HashTable<K, uint32_t, H> table(HASH_TABLE_SIZE);
+    for (size_t i = 0; i < keys.size(); i++) {
+        table.insert(keys[i], static_cast<uint32_t>(i));
+    }
+
+    vector<size_t> counts = table.getProbeCounts();
+    size_t total = 0;
+    size_t weighted = 0;
+    for (size_t d = 1; d < counts.size(); d++) {
+        total = total + counts[d];
+        weighted = weighted + d * counts[d];
+    }
+
+    uint64_t found = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (const K& key : keys) {
+            uint32_t value;
+            found = found + (table.find(key, value) ? 1 : 0);
+        }
+    }
+    auto stop = chrono::steady_clock::now();
+
+    if (found != keys.size() * LOOKUP_ROUNDS) {
+        cout << "Lookup missed a key" << endl;
+        exit(1);
+    }
+
+    ProbeStats stats;
+    stats.mean = static_cast<double>(weighted) / total;
+    stats.longest = counts.size() - 1;
+    stats.home = 100.0 * counts[1] / total;
+    stats.lookupNs = chrono::duration<double, nano>(stop - start).count() / (keys.size() * LOOKUP_ROUNDS);
+    return stats;
+}
+
+void printRow(const string& keySet, size_t count, const string& hash, const ProbeStats& stats) {
+    cout << left << setw(22) << keySet << right << setw(9) << count << "  " << left << setw(8) << hash << right
+         << fixed << setprecision(2) << setw(12) << stats.mean << setw(10) << stats.longest
+         << setprecision(1) << setw(10) << stats.home << "%" << setprecision(1) << setw(12) << stats.lookupNs << endl;
+}
+
+template<typename K, typename OldHash>
+void compare(const string& keySet, const vector<K>& keys) {
+    printRow(keySet, keys.size(), "old", measure<K, OldHash>(keys));
+    printRow(keySet, keys.size(), "policy", measure<K, HashPolicy<K>>(keys));
+}
+
+vector<string> splitLine(const string& line) {
+    vector<string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t bar = line.find('|', start);
+        fields.push_back(line.substr(start, bar == string::npos ? string::npos : bar - start));
+        if (bar == string::npos) {
+            return fields;
+        }
+        start = bar + 1;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string dataDir = argc > 1 ? argv[1] : "ml-100k";
+
+    vector<uint64_t> ratingKeys;
+    ifstream ratings(dataDir + "/u.data");
+    uint64_t userID;
+    uint64_t movieID;
+    uint64_t rating;
+    uint64_t timestamp;
+    while (ratings >> userID >> movieID >> rating >> timestamp) {
+        ratingKeys.push_back((userID << 32) | movieID);
+    }
+
+    vector<string> titles;
+    ifstream items(dataDir + "/u.item");
+    string line;
+    while (getline(items, line)) {
+        vector<string> fields = splitLine(line);
+        if (fields.size() > 1 && !fields[1].empty()) {
+            titles.push_back(fields[1]);
+        }
+    }
+
+    if (ratingKeys.empty() || titles.empty()) {
+        cout << "Could not read " << dataDir << "/u.data and u.item" << endl;
+        return 1;
+    }
+
+    vector<uint64_t> sequential;
+    for (uint64_t id = 1; id <= 1000000; id++) {
+        sequential.push_back(id);
+    }
+
+    vector<uint64_t> offsets;
+    for (uint64_t page = 1; page <= 200000; page++) {
+        offsets.push_back(page * BLOCK_SIZE);
+    }
+
+    vector<string> usernames;
+    for (uint32_t id = 1; id <= 100000; id++) {
+        usernames.push_back("user" + to_string(id));
+    }
+
+    cout << left << setw(22) << "keys" << right << setw(9) << "count" << "  " << left << setw(8) << "hash" << right
+         << setw(12) << "mean probe" << setw(10) << "longest" << setw(11) << "at home" << setw(12) << "lookup ns" << endl;
+
+    compare<uint64_t, OldIntegerHash>("sequential IDs", sequential);
+    compare<uint64_t, OldIntegerHash>("ml-100k rating keys", ratingKeys);
+    compare<uint64_t, OldIntegerHash>("4 KB node offsets", offsets);
+    compare<string, OldStringHash>("ml-100k titles", titles);
+    compare<string, OldStringHash>("usernames", usernames);
+    return 0;
+}
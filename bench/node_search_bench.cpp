@@ -0,0 +1,115 @@
+// Per-node key search cost: the linear scan BTree used before NodeSearch,
+// against the NodeSearch kernel this build selects (AVX2 for uint32_t keys
+// when compiled with -mavx2, branchless binary search otherwise).
+//
+//   g++ -O2 -std=c++17 bench/node_search_bench.cpp -o node_search_bench
+//   g++ -O2 -std=c++17 -mavx2 bench/node_search_bench.cpp -o node_search_bench
+
+#include "../core/btree.h"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+typedef BTreeNode<uint32_t, uint32_t> Node;
+
+const size_t NODE_COUNT = 4096;
+const size_t SEARCHES = 20000000;
+
+uint32_t linearLowerBound(const uint32_t* keys, uint32_t count, uint32_t key) {
+    uint32_t i = 0;
+    while (i < count && keys[i] < key) {
+        i++;
+    }
+    return i;
+}
+
+uint32_t linearUpperBound(const uint32_t* keys, uint32_t count, uint32_t key) {
+    uint32_t i = 0;
+    while (i < count && !(key < keys[i])) {
+        i++;
+    }
+    return i;
+}
+
+// Sorted distinct keys, numKeys per node, spread over enough nodes that
+// they do not all sit in L1.
+vector<uint32_t> makeNodes(uint32_t numKeys, mt19937& rng) {
+    vector<uint32_t> keys(NODE_COUNT * Node::MAX_KEYS, 0);
+    for (size_t n = 0; n < NODE_COUNT; n++) {
+        uint32_t* node = keys.data() + n * Node::MAX_KEYS;
+        uint32_t next = rng() % 1000;
+        for (uint32_t i = 0; i < numKeys; i++) {
+            node[i] = next;
+            next = next + 1 + rng() % 64;
+        }
+    }
+    return keys;
+}
+
+template<typename F>
+double nsPerSearch(const vector<uint32_t>& keys, uint32_t numKeys, const vector<uint32_t>& probes,
+    F search, uint64_t& checksum) {
+    uint64_t sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < SEARCHES; i++) {
+        const uint32_t* node = keys.data() + (i % NODE_COUNT) * Node::MAX_KEYS;
+        sum = sum + search(node, numKeys, probes[i % probes.size()]);
+    }
+    auto stop = chrono::steady_clock::now();
+
+    checksum = sum;
+    return chrono::duration<double, nano>(stop - start).count() / SEARCHES;
+}
+
+int main() {
+#ifdef __AVX2__
+    const char* kernel = "AVX2";
+#else
+    const char* kernel = "branchless";
+#endif
+
+    cout << "Node capacity: " << Node::MAX_KEYS << " uint32_t keys, NodeSearch kernel: " << kernel << endl;
+    cout << setw(6) << "keys" << setw(10) << "bound" << setw(14) << "linear ns"
+         << setw(14) << "search ns" << setw(10) << "speedup" << endl;
+
+    mt19937 rng(12345);
+    vector<uint32_t> probes(1 << 16);
+    for (uint32_t& probe : probes) {
+        probe = rng() % (Node::MAX_KEYS * 33);
+    }
+
+    uint32_t sizes[] = { 8, 32, Node::DEGREE, Node::MAX_KEYS };
+    for (uint32_t numKeys : sizes) {
+        vector<uint32_t> keys = makeNodes(numKeys, rng);
+
+        for (int upper = 0; upper < 2; upper++) {
+            uint64_t linearSum;
+            uint64_t searchSum;
+            double linear;
+            double search;
+
+            if (upper) {
+                linear = nsPerSearch(keys, numKeys, probes, linearUpperBound, linearSum);
+                search = nsPerSearch(keys, numKeys, probes, NodeSearch<uint32_t>::upperBound, searchSum);
+            }
+            else {
+                linear = nsPerSearch(keys, numKeys, probes, linearLowerBound, linearSum);
+                search = nsPerSearch(keys, numKeys, probes, NodeSearch<uint32_t>::lowerBound, searchSum);
+            }
+
+            if (linearSum != searchSum) {
+                cout << "Result mismatch for " << numKeys << " keys" << endl;
+                return 1;
+            }
+
+            cout << setw(6) << numKeys << setw(10) << (upper ? "upper" : "lower")
+                 << fixed << setprecision(2) << setw(14) << linear << setw(14) << search
+                 << setw(9) << linear / search << "x" << endl;
+        }
+    }
+    return 0;
+}
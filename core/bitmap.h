@@ -5,105 +5,254 @@
 #include <cstring>
 #include "types.h"
 
+// One bit per block, set = in use. Bits are packed into 64-bit words and a
+// second-level summary keeps one bit per word that still has a free block,
+// so a search skips full words 64 at a time and lands on the free bit with
+// ctz. Bits past numBlocks in the last word stay clear; searches stop at
+// numBlocks, which is also what they return when nothing is free.
+//
+// serialize() writes the words' bytes as they are, which on little-endian
+// hosts is the same bit order the byte-wise map used (block n is bit n % 8
+// of byte n / 8).
 class Bitmap {
 private:
-    uint8_t* data;
+    static const uint64_t FULL = ~0ull;
+
+    uint64_t* words;
+    uint64_t* summary;
     size_t numBlocks;
+    size_t numWords;
+    size_t numSummary;
+    size_t usedBlocks;
 
-public:
-    Bitmap(size_t totalBlocks) : numBlocks(totalBlocks) {
-        size_t byteSize = numBlocks / 8;
-        if (numBlocks % 8 != 0)
-            byteSize++;
+    void allocate(size_t totalBlocks) {
+        numBlocks = totalBlocks;
+        numWords = (numBlocks + 63) / 64;
+        numSummary = (numWords + 63) / 64;
+
+        words = new uint64_t[numWords + 1];
+        summary = new uint64_t[numSummary + 1];
+        memset(words, 0, (numWords + 1) * sizeof(uint64_t));
+        memset(summary, 0, (numSummary + 1) * sizeof(uint64_t));
+    }
+
+    void refreshSummary(size_t word) {
+        uint64_t bit = 1ull << (word % 64);
+        if (words[word] == FULL) {
+            summary[word / 64] = summary[word / 64] & ~bit;
+        }
+        else {
+            summary[word / 64] = summary[word / 64] | bit;
+        }
+    }
+
+    // Clears bits past numBlocks and recomputes the summary and the count.
+    void rebuild() {
+        if (numBlocks % 64 != 0) {
+            words[numWords - 1] = words[numWords - 1] & ((1ull << (numBlocks % 64)) - 1);
+        }
 
-        data = new uint8_t[byteSize];
-        memset(data, 0, byteSize);
+        usedBlocks = 0;
+        memset(summary, 0, (numSummary + 1) * sizeof(uint64_t));
+        for (size_t w = 0; w < numWords; w++) {
+            usedBlocks = usedBlocks + __builtin_popcountll(words[w]);
+            refreshSummary(w);
+        }
+    }
 
+    // First word at or after from with a free bit, or numWords.
+    size_t nextOpenWord(size_t from) const {
+        if (from >= numWords) {
+            return numWords;
+        }
+
+        size_t s = from / 64;
+        uint64_t open = summary[s] & (FULL << (from % 64));
+        while (open == 0) {
+            s++;
+            if (s >= numSummary) {
+                return numWords;
+            }
+            open = summary[s];
+        }
+        return s * 64 + __builtin_ctzll(open);
+    }
+
+    void setRange(size_t start, size_t count) {
+        size_t end = start + count;
+        while (start < end) {
+            size_t w = start / 64;
+            size_t bit = start % 64;
+            size_t span = 64 - bit < end - start ? 64 - bit : end - start;
+            uint64_t mask = (span == 64 ? FULL : ((1ull << span) - 1)) << bit;
+
+            usedBlocks = usedBlocks + __builtin_popcountll(mask & ~words[w]);
+            words[w] = words[w] | mask;
+            refreshSummary(w);
+            start = start + span;
+        }
+    }
+
+public:
+    Bitmap(size_t totalBlocks) : usedBlocks(0) {
+        allocate(totalBlocks);
+        rebuild();
         setBit(0);
     }
 
     ~Bitmap() {
-        delete[] data;
+        delete[] words;
+        delete[] summary;
     }
 
+    Bitmap(const Bitmap&) = delete;
+    Bitmap& operator=(const Bitmap&) = delete;
+
     void setBit(size_t blockNum) {
-        size_t byteIndex = blockNum / 8;
-        size_t bitIndex = blockNum % 8;
-
-        switch (bitIndex) {
-        case 7: data[byteIndex] = data[byteIndex] | 0x80; break;
-        case 6: data[byteIndex] = data[byteIndex] | 0x40; break;
-        case 5: data[byteIndex] = data[byteIndex] | 0x20; break;
-        case 4: data[byteIndex] = data[byteIndex] | 0x10; break;
-        case 3: data[byteIndex] = data[byteIndex] | 0x08; break;
-        case 2: data[byteIndex] = data[byteIndex] | 0x04; break;
-        case 1: data[byteIndex] = data[byteIndex] | 0x02; break;
-        case 0: data[byteIndex] = data[byteIndex] | 0x01; break;
+        size_t w = blockNum / 64;
+        uint64_t bit = 1ull << (blockNum % 64);
+        if ((words[w] & bit) == 0) {
+            words[w] = words[w] | bit;
+            usedBlocks++;
+            refreshSummary(w);
         }
     }
 
-
-
     void clearBit(size_t blockNum) {
-        size_t byteIndex = blockNum / 8;
-        size_t bitIndex = blockNum % 8;
-
-        switch (bitIndex) {
-        case 7: data[byteIndex] = data[byteIndex] & (~0x80); break;
-        case 6: data[byteIndex] = data[byteIndex] & (~0x40); break;
-        case 5: data[byteIndex] = data[byteIndex] & (~0x20); break;
-        case 4: data[byteIndex] = data[byteIndex] & (~0x10); break;
-        case 3: data[byteIndex] = data[byteIndex] & (~0x08); break;
-        case 2: data[byteIndex] = data[byteIndex] & (~0x04); break;
-        case 1: data[byteIndex] = data[byteIndex] & (~0x02); break;
-        case 0: data[byteIndex] = data[byteIndex] & (~0x01); break;
+        size_t w = blockNum / 64;
+        uint64_t bit = 1ull << (blockNum % 64);
+        if ((words[w] & bit) != 0) {
+            words[w] = words[w] & ~bit;
+            usedBlocks--;
+            refreshSummary(w);
         }
     }
 
+    bool isFree(size_t blockNum) const {
+        return (words[blockNum / 64] & (1ull << (blockNum % 64))) == 0;
+    }
 
+    // Lowest free block from 1 upward, or getNumBlocks() if none.
+    size_t findFreeBlock() const {
+        return findFreeBlock(1);
+    }
 
-    bool isFree(size_t blockNum) const {
-        size_t byteIndex = blockNum / 8;
-        size_t bitIndex = blockNum % 8;
-
-        uint8_t byte = data[byteIndex];
-
-        switch (bitIndex) {
-        case 7: return (byte & 0x80) == 0;
-        case 6: return (byte & 0x40) == 0;
-        case 5: return (byte & 0x20) == 0;
-        case 4: return (byte & 0x10) == 0;
-        case 3: return (byte & 0x08) == 0;
-        case 2: return (byte & 0x04) == 0;
-        case 1: return (byte & 0x02) == 0;
-        case 0: return (byte & 0x01) == 0;
+    size_t findFreeBlock(size_t from) const {
+        if (from >= numBlocks) {
+            return numBlocks;
+        }
+
+        size_t w = from / 64;
+        uint64_t open = ~words[w] & (FULL << (from % 64));
+        if (open == 0) {
+            w = nextOpenWord(w + 1);
+            if (w >= numWords) {
+                return numBlocks;
+            }
+            open = ~words[w];
         }
 
-        return false;
+        size_t block = w * 64 + __builtin_ctzll(open);
+        return block < numBlocks ? block : numBlocks;
     }
 
+    // Lowest block at or after from that is in use, or getNumBlocks().
+    size_t findUsedBlock(size_t from) const {
+        if (from >= numBlocks) {
+            return numBlocks;
+        }
 
-    size_t findFreeBlock() const {
-        for (size_t i = 1; i < numBlocks; i++) {
-            if (isFree(i)) return i;
+        size_t w = from / 64;
+        uint64_t used = words[w] & (FULL << (from % 64));
+        while (used == 0) {
+            w++;
+            if (w >= numWords) {
+                return numBlocks;
+            }
+            used = words[w];
+        }
+        return w * 64 + __builtin_ctzll(used);
+    }
+
+    // Finds count contiguous free blocks from block 1 upward, marks them in
+    // use and returns the first. Returns getNumBlocks() and changes nothing
+    // if there is no such run.
+    size_t allocateRun(size_t count) {
+        if (count == 0) {
+            return numBlocks;
+        }
+
+        size_t runStart = 0;
+        size_t runLength = 0;
+        size_t w = nextOpenWord(0);
+
+        while (w < numWords) {
+            uint64_t word = words[w];
+            for (size_t bit = 0; bit < 64; bit++) {
+                size_t block = w * 64 + bit;
+                if (block == 0 || block >= numBlocks || (word & (1ull << bit)) != 0) {
+                    runLength = 0;
+                    continue;
+                }
+
+                if (runLength == 0) {
+                    runStart = block;
+                }
+                runLength++;
+                if (runLength == count) {
+                    setRange(runStart, count);
+                    return runStart;
+                }
+
+                // A wholly free rest of the word extends the run in one step.
+                if (bit + 1 < 64 && (word >> (bit + 1)) == 0 && block + 64 - bit <= numBlocks) {
+                    size_t rest = 63 - bit;
+                    if (runLength + rest >= count) {
+                        setRange(runStart, count);
+                        return runStart;
+                    }
+                    runLength = runLength + rest;
+                    break;
+                }
+            }
+
+            size_t next = nextOpenWord(w + 1);
+            if (next != w + 1) {
+                runLength = 0;
+            }
+            w = next;
         }
         return numBlocks;
     }
 
-    void serialize(char* buffer) const {
-        size_t byteSize = numBlocks / 8;
-        if (numBlocks % 8 != 0)
-            byteSize++;
+    size_t countFree() const {
+        return numBlocks - usedBlocks;
+    }
 
-        memcpy(buffer, data, byteSize);
+    void serialize(char* buffer) const {
+        memcpy(buffer, words, getByteSize());
     }
 
     void deserialize(const char* buffer) {
-        size_t byteSize = numBlocks / 8;
-        if (numBlocks % 8 != 0)
-            byteSize++;
+        memset(words, 0, numWords * sizeof(uint64_t));
+        memcpy(words, buffer, getByteSize());
+        rebuild();
+    }
+
+    void resize(size_t totalBlocks) {
+        uint64_t* oldWords = words;
+        size_t oldNumWords = numWords;
+        delete[] summary;
+
+        allocate(totalBlocks);
+        memcpy(words, oldWords, (oldNumWords < numWords ? oldNumWords : numWords) * sizeof(uint64_t));
+        delete[] oldWords;
 
-        memcpy(data, buffer, byteSize);
+        rebuild();
+    }
+
+    size_t getNumBlocks() const {
+        return numBlocks;
     }
 
     size_t getByteSize() const {
@@ -114,4 +263,4 @@ public:
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -3,117 +3,272 @@
 
 #include <cstdint>
 #include <vector>
-#include <fstream>
 #include <cstring>
 #include <string>
 #include <stdexcept>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cstdio>
+#include "bitmap.h"
+#include "page_cache.h"
+#include "node_search.h"
+#include "wal.h"
 #include "types.h"
 
 using namespace std;
 
+// Value type for key-only (set) trees. It takes no space in a node page.
+struct BTreeNoValue {
+    bool operator==(const BTreeNoValue&) const {
+        return true;
+    }
+};
+
+// Values of index files written before the versioned header were all
+// uint64_t; see BTree::migrateLegacyFile().
+template<typename V>
+V legacyValue(uint64_t value) {
+    return static_cast<V>(value);
+}
+
+template<>
+inline BTreeNoValue legacyValue<BTreeNoValue>(uint64_t) {
+    return BTreeNoValue();
+}
+
+// Largest degree for which a node of 2 * degree - 1 keys fits one page,
+// whether it carries values (leaf) or child offsets (internal).
+constexpr uint32_t btreeDegree(size_t headerSize, size_t keySize, size_t valueSize) {
+    return static_cast<uint32_t>(
+        ((BLOCK_SIZE - headerSize - 2 * sizeof(uint64_t)) /
+        (keySize + (valueSize > sizeof(uint64_t) ? valueSize : sizeof(uint64_t))) + 1) / 2);
+}
+
+// A node is serialized into one BLOCK_SIZE page: a 24-byte header (leaf
+// flag, key count, leaf link, own offset), the live keys, then the values
+// of a leaf or the child offsets of an internal node, 8-byte aligned.
 template<typename K, typename V>
 struct BTreeNode {
+    static const size_t HEADER_SIZE = 24;
+    static const size_t VALUE_SIZE = is_empty<V>::value ? 0 : sizeof(V);
+    static const uint32_t DEGREE = btreeDegree(HEADER_SIZE, sizeof(K), VALUE_SIZE);
+    static const uint32_t MAX_KEYS = 2 * DEGREE - 1;
+    static const size_t KEYS_AT = HEADER_SIZE;
+    static const size_t PAYLOAD_AT = ((KEYS_AT + sizeof(K) * MAX_KEYS + 7) / 8) * 8;
+
+    static_assert(DEGREE >= 2, "Key and value types too large for a node page");
+    static_assert(PAYLOAD_AT + sizeof(uint64_t) * (MAX_KEYS + 1) <= BLOCK_SIZE, "Internal node exceeds a page");
+    static_assert(PAYLOAD_AT + VALUE_SIZE * MAX_KEYS <= BLOCK_SIZE, "Leaf node exceeds a page");
+
     bool isLeaf;
     uint32_t numKeys;
-    K keys[2 * BTREE_DEGREE - 1];
-    V values[2 * BTREE_DEGREE - 1];
-    uint64_t children[2 * BTREE_DEGREE];
+    K keys[MAX_KEYS];
+    V values[MAX_KEYS];
+    uint64_t children[MAX_KEYS + 1];
+    uint64_t nextLeaf;
     uint64_t nodeOffset;
 
-    BTreeNode() : isLeaf(true), numKeys(0), nodeOffset(0) {
+    BTreeNode() : isLeaf(true), numKeys(0), nextLeaf(0), nodeOffset(0) {
         memset(keys, 0, sizeof(keys));
         memset(values, 0, sizeof(values));
         memset(children, 0, sizeof(children));
     }
 
     void serialize(char* buffer) const {
-        size_t offset = 0;
+        memset(buffer, 0, BLOCK_SIZE);
 
         if (isLeaf) {
-            buffer[offset++] = 1;
+            buffer[0] = 1;
         }
         else {
-            buffer[offset++] = 0;
+            buffer[0] = 0;
         }
 
+        memcpy(buffer + 1, &numKeys, sizeof(uint32_t));
+        memcpy(buffer + 8, &nextLeaf, sizeof(uint64_t));
+        memcpy(buffer + 16, &nodeOffset, sizeof(uint64_t));
 
-        memcpy(buffer + offset, &numKeys, sizeof(uint32_t));
-        offset = offset + sizeof(uint32_t);
+        memcpy(buffer + KEYS_AT, keys, sizeof(K) * numKeys);
+        if (isLeaf) {
+            if (VALUE_SIZE > 0) {
+                memcpy(buffer + PAYLOAD_AT, values, VALUE_SIZE * numKeys);
+            }
+        }
+        else {
+            memcpy(buffer + PAYLOAD_AT, children, sizeof(uint64_t) * (numKeys + 1));
+        }
+    }
 
-        memcpy(buffer + offset, keys, sizeof(K) * (2 * BTREE_DEGREE - 1));
-        offset = offset + sizeof(K) * (2 * BTREE_DEGREE - 1);
+    static BTreeNode<K, V> deserialize(const char* buffer) {
+        BTreeNode<K, V> node;
 
-        memcpy(buffer + offset, values, sizeof(V) * (2 * BTREE_DEGREE - 1));
-        offset = offset + sizeof(V) * (2 * BTREE_DEGREE - 1);
+        node.isLeaf = (buffer[0] == 1);
+        memcpy(&node.numKeys, buffer + 1, sizeof(uint32_t));
+        memcpy(&node.nextLeaf, buffer + 8, sizeof(uint64_t));
+        memcpy(&node.nodeOffset, buffer + 16, sizeof(uint64_t));
 
-        memcpy(buffer + offset, children, sizeof(uint64_t) * (2 * BTREE_DEGREE));
-        offset = offset + sizeof(uint64_t) * (2 * BTREE_DEGREE);
+        if (node.numKeys > MAX_KEYS) {
+            throw runtime_error("Corrupted index node");
+        }
 
-        memcpy(buffer + offset, &nodeOffset, sizeof(uint64_t));
+        memcpy(node.keys, buffer + KEYS_AT, sizeof(K) * node.numKeys);
+        if (node.isLeaf) {
+            if (VALUE_SIZE > 0) {
+                memcpy(node.values, buffer + PAYLOAD_AT, VALUE_SIZE * node.numKeys);
+            }
+        }
+        else {
+            memcpy(node.children, buffer + PAYLOAD_AT, sizeof(uint64_t) * (node.numKeys + 1));
+        }
+
+        return node;
     }
 
-    static BTreeNode<K, V> deserialize(const char* buffer) {
-        BTreeNode<K, V> node;
-        size_t offset = 0;
+    static size_t getSerializedSize() {
+        return BLOCK_SIZE;
+    }
 
-        node.isLeaf = (buffer[offset++] == 1);
+};
 
-        memcpy(&node.numKeys, buffer + offset, sizeof(uint32_t));
-        offset = offset + sizeof(uint32_t);
+// Read-only view of a serialized node. The memory-mapped mode searches
+// nodes through it where they lie in the mapping instead of copying them.
+template<typename K, typename V>
+class BTreeNodeView {
+private:
+    typedef BTreeNode<K, V> Node;
+
+    const char* data;
+
+public:
+    explicit BTreeNodeView(const char* buffer) : data(buffer) {}
 
-        memcpy(node.keys, buffer + offset, sizeof(K) * (2 * BTREE_DEGREE - 1));
-        offset = offset + sizeof(K) * (2 * BTREE_DEGREE - 1);
+    bool isLeaf() const {
+        return data[0] == 1;
+    }
 
-        memcpy(node.values, buffer + offset, sizeof(V) * (2 * BTREE_DEGREE - 1));
-        offset = offset + sizeof(V) * (2 * BTREE_DEGREE - 1);
+    uint32_t numKeys() const {
+        uint32_t count;
+        memcpy(&count, data + 1, sizeof(uint32_t));
+        return count;
+    }
 
-        memcpy(node.children, buffer + offset, sizeof(uint64_t) * (2 * BTREE_DEGREE));
-        offset = offset + sizeof(uint64_t) * (2 * BTREE_DEGREE);
+    // Keys start 8-byte aligned within a page-aligned node.
+    const K* keys() const {
+        return reinterpret_cast<const K*>(data + Node::KEYS_AT);
+    }
 
-        memcpy(&node.nodeOffset, buffer + offset, sizeof(uint64_t));
+    K keyAt(uint32_t i) const {
+        K key;
+        memcpy(&key, data + Node::KEYS_AT + i * sizeof(K), sizeof(K));
+        return key;
+    }
 
-        return node;
+    V valueAt(uint32_t i) const {
+        V value = V();
+        if (Node::VALUE_SIZE > 0) {
+            memcpy(&value, data + Node::PAYLOAD_AT + i * Node::VALUE_SIZE, Node::VALUE_SIZE);
+        }
+        return value;
     }
 
-    static size_t getSerializedSize() {
-        return 1 + sizeof(uint32_t) +
-            sizeof(K) * (2 * BTREE_DEGREE - 1) +
-            sizeof(V) * (2 * BTREE_DEGREE - 1) +
-            sizeof(uint64_t) * (2 * BTREE_DEGREE) +
-            sizeof(uint64_t);
+    uint64_t childAt(uint32_t i) const {
+        uint64_t child;
+        memcpy(&child, data + Node::PAYLOAD_AT + i * sizeof(uint64_t), sizeof(uint64_t));
+        return child;
+    }
+
+    uint32_t lowerBound(const K& key) const {
+        return NodeSearch<K>::lowerBound(keys(), numKeys(), key);
     }
 
+    uint32_t upperBound(const K& key) const {
+        return NodeSearch<K>::upperBound(keys(), numKeys(), key);
+    }
 };
 
+// B+tree: values live only in leaves, internal keys are separators (the
+// smallest key of the right subtree) and leaves are linked left to right.
+//
+// Node I/O uses pread/pwrite so threads never share a file cursor. Every
+// node has a reader/writer latch; operations crab down the tree holding at
+// most a parent and a child latch. Writers split or refill a child before
+// stepping into it, so the parent can be released as soon as the child is
+// latched. Bulk loading, create() and close() need exclusive use.
+//
+// Node slots freed by merges are tracked in a Bitmap (block n is the page
+// at n * BLOCK_SIZE) and reused before the file grows; compact() rewrites
+// the tree densely.
+//
+// With a WriteAheadLog attached, the pages written by each split, refill or
+// leaf update are logged as one record before they can reach the file. A
+// new root or key count is part of that record, and the header and free
+// map in the file are only rewritten by flush(), after the log is synced.
+// Without one, each insert or remove writes its pages and then the header
+// straight to the file; the free map is still only saved by flush().
+//
+// In memory-mapped mode the file is mapped privately instead of going
+// through the PageCache. Lookups and descents read nodes in place; writes
+// land in the mapping (copy-on-write, so they cannot reach the file on
+// their own) and dirty nodes are written back with pwrite on flush().
 template<typename K, typename V>
 class BTree {
 private:
-    uint64_t rootOffset;
+    static const uint32_t DEGREE = BTreeNode<K, V>::DEGREE;
+
+    atomic<uint64_t> rootOffset;
     string indexFile;
-    fstream file;
+    int fd;
     uint64_t nextFreeOffset;
+    atomic<uint64_t> keyCount;
+    atomic<uint64_t> structureVersion;
 
-    mutable mutex fileMutex;
+    Bitmap* freeMap;
+    size_t freeSlots;
+    bool mapSaved;
 
+    mutable mutex allocMutex;
+    shared_mutex treeLatch;
+    shared_mutex rootLatch;
 
-    BTreeNode<K, V> readNode(uint64_t offset) {
+    HashTable<uint64_t, shared_mutex*>* latches;
+    mutex latchTableMutex;
 
-        lock_guard<mutex> lock(fileMutex);
+    PageCache<BTreeNode<K, V>>* cache;
 
-        if (offset == 0) {
-            throw runtime_error("Cannot read at offset 0");
+    WriteAheadLog* wal;
+    uint32_t walTarget;
+
+    bool memoryMapped;
+    char* mapBase;
+    uint64_t mappedBytes;
+    atomic<uint64_t> fileBytes;
+    Bitmap* dirtyMap;
+
+    // The pages written by one split, refill or leaf update, and latches
+    // that must stay held until they are published.
+    struct Step {
+        WriteAheadLog::Batch batch;
+        vector<BTreeNode<K, V>> nodes;
+        vector<unique_lock<shared_mutex>> guards;
+
+        void hold(unique_lock<shared_mutex>& guard) {
+            guards.push_back(move(guard));
         }
+    };
 
+    BTreeNode<K, V> readNodeFromDisk(uint64_t offset) {
         size_t serialSize = BTreeNode<K, V>::getSerializedSize();
         char* buffer = new char[serialSize];
         memset(buffer, 0, serialSize);
 
-        file.seekg(offset, ios::beg);
-        file.read(buffer, serialSize);
+        ssize_t bytesRead = pread(fd, buffer, serialSize, static_cast<off_t>(offset));
 
-        if (file.fail() || file.gcount() != static_cast<streamsize>(serialSize)) {
-            file.clear();
+        if (bytesRead != static_cast<ssize_t>(serialSize)) {
             delete[] buffer;
             throw runtime_error("Failed to read from disk");
         }
@@ -123,83 +278,411 @@ private:
         return node;
     }
 
-    void writeNode(BTreeNode<K, V>& node, uint64_t offset) {
-        lock_guard<mutex> lock(fileMutex);
+    void writeNodeToDisk(const BTreeNode<K, V>& node, uint64_t offset) {
+        size_t serialSize = BTreeNode<K, V>::getSerializedSize();
+        char* buffer = new char[serialSize];
+        memset(buffer, 0, serialSize);
+
+        node.serialize(buffer);
+
+        ssize_t written = pwrite(fd, buffer, serialSize, static_cast<off_t>(offset));
+
+        if (written != static_cast<ssize_t>(serialSize)) {
+            delete[] buffer;
+            throw runtime_error("Failed to write to disk");
+        }
+
+        delete[] buffer;
+    }
+
+    // Callers hold the node's latch, shared or exclusive.
+    BTreeNode<K, V> readNode(uint64_t offset) {
+        if (offset == 0) {
+            throw runtime_error("Cannot read at offset 0");
+        }
+
+        if (mapBase != nullptr) {
+            return BTreeNode<K, V>::deserialize(mappedNode(offset));
+        }
+
+        BTreeNode<K, V> node;
+        if (cache->get(offset, node)) {
+            return node;
+        }
 
+        node = readNodeFromDisk(offset);
+        cache->put(offset, node, false);
+        return node;
+    }
+
+    // Callers hold the node's latch exclusively and pass the step on to
+    // logStep() once the rest of it is written. Until then the page is
+    // only recorded in the step.
+    void writeNode(BTreeNode<K, V>& node, uint64_t offset, Step& step) {
         if (offset == 0) {
             throw runtime_error("Cannot write at offset 0");
         }
 
         node.nodeOffset = offset;
+        step.nodes.push_back(node);
+
+        if (wal != nullptr) {
+            size_t serialSize = BTreeNode<K, V>::getSerializedSize();
+            char* buffer = new char[serialSize];
+            memset(buffer, 0, serialSize);
+            node.serialize(buffer);
+            step.batch.add(walTarget, offset, buffer, static_cast<uint32_t>(serialSize));
+            delete[] buffer;
+        }
+    }
+
+    // Logs the pages of one structural step, plus the header when the root
+    // or key count it depends on changed, and only then publishes them to
+    // the cache or mapping. A page can reach the file only after it is in
+    // the cache or marked dirty, and the log is synced before that, so no
+    // part of a step is written ahead of its record. Without a log the
+    // pages are written through instead. The step's latches are released
+    // last.
+    void logStep(Step& step, bool withHeader) {
+        if (wal != nullptr) {
+            if (withHeader) {
+                char header[METADATA_SIZE];
+                {
+                    lock_guard<mutex> lock(allocMutex);
+                    encodeHeader(header, 0);
+                }
+                step.batch.add(walTarget, 0, header, METADATA_SIZE);
+            }
+            wal->append(step.batch);
+        }
+
+        for (const BTreeNode<K, V>& node : step.nodes) {
+            if (mapBase != nullptr) {
+                node.serialize(mapBase + node.nodeOffset);
+                if (wal != nullptr) {
+                    markDirty(node.nodeOffset);
+                }
+            }
+            else {
+                cache->put(node.nodeOffset, node, true);
+            }
+
+            if (wal == nullptr) {
+                writeNodeToDisk(node, node.nodeOffset);
+            }
+        }
+        step.nodes.clear();
+        step.guards.clear();
+    }
+
+    // Ends an insert or remove. Without a log, nothing else would bring
+    // the file's header up to date with the pages written through, so it
+    // is written here. With a log the header is in the step records and
+    // reaches the file on flush(), after the pages it points at.
+    void saveOperation() {
+        if (wal != nullptr) {
+            return;
+        }
+
+        lock_guard<mutex> lock(allocMutex);
+
+        char header[METADATA_SIZE];
+        encodeHeader(header, 0);
+        if (pwrite(fd, header, METADATA_SIZE, 0) != static_cast<ssize_t>(METADATA_SIZE)) {
+            throw runtime_error("Failed to save metadata");
+        }
+        mapSaved = false;
+    }
+
+    // Syncs the file and tells the log that earlier page images for it are
+    // obsolete, after the file was rewritten outside the log.
+    void markRewritten() {
+        fdatasync(fd);
+        if (wal != nullptr) {
+            wal->reset(walTarget);
+        }
+    }
+
+    // Reserves address space for the largest index up front, so the mapping
+    // never moves under in-place readers as the file grows.
+    void mapFile() {
+        void* base = mmap(nullptr, BTREE_MMAP_RESERVE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            throw runtime_error("Failed to reserve index mapping");
+        }
+
+        mapBase = static_cast<char*>(base);
+        mappedBytes = 0;
+
+        off_t size = lseek(fd, 0, SEEK_END);
+        fileBytes = size > 0 ? static_cast<uint64_t>(size) : 0;
+        growMapping(fileBytes);
+
+        delete dirtyMap;
+        dirtyMap = new Bitmap(2 * blockFor(nextFreeOffset));
+    }
+
+    void unmapFile() {
+        if (mapBase != nullptr) {
+            munmap(mapBase, BTREE_MMAP_RESERVE);
+            mapBase = nullptr;
+        }
+    }
+
+    // Maps the file afresh, dropping private copies of nodes after the file
+    // was rewritten underneath them.
+    void remapFile() {
+        unmapFile();
+        mapFile();
+    }
+
+    // Extends the file-backed part of the reservation to cover bytes,
+    // doubling each time. Caller holds allocMutex or exclusive use.
+    void growMapping(uint64_t bytes) {
+        if (bytes <= mappedBytes) {
+            return;
+        }
+        if (bytes > BTREE_MMAP_RESERVE) {
+            throw runtime_error("Index file exceeds the mapped region");
+        }
+
+        uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        uint64_t target = bytes > 2 * mappedBytes ? bytes : 2 * mappedBytes;
+        target = ((target + pageSize - 1) / pageSize) * pageSize;
+        if (target > BTREE_MMAP_RESERVE) {
+            target = BTREE_MMAP_RESERVE;
+        }
+
+        void* chunk = mmap(mapBase + mappedBytes, target - mappedBytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(mappedBytes));
+        if (chunk == MAP_FAILED) {
+            throw runtime_error("Failed to map index file");
+        }
+        mappedBytes = target;
+    }
+
+    const char* mappedNode(uint64_t offset) const {
+        if (offset + BTreeNode<K, V>::getSerializedSize() > fileBytes) {
+            throw runtime_error("Node offset past end of mapped index");
+        }
+        return mapBase + offset;
+    }
+
+    void markDirty(uint64_t offset) {
+        lock_guard<mutex> lock(allocMutex);
+
+        size_t block = blockFor(offset);
+        if (block >= dirtyMap->getNumBlocks()) {
+            dirtyMap->resize(2 * block);
+        }
+        dirtyMap->setBit(block);
+    }
+
+    // Writes dirty nodes back to the file. Each node is copied under its
+    // latch, so its image is already in the log, which is made durable
+    // before any of the copies reach the file.
+    void flushNodes() {
+        if (mapBase == nullptr) {
+            cache->flush();
+            return;
+        }
+
+        vector<uint64_t> offsets;
+        {
+            lock_guard<mutex> lock(allocMutex);
+            size_t numBlocks = dirtyMap->getNumBlocks();
+            for (size_t block = dirtyMap->findUsedBlock(1); block < numBlocks;
+                block = dirtyMap->findUsedBlock(block + 1)) {
+                offsets.push_back(offsetFor(block));
+            }
+            delete dirtyMap;
+            dirtyMap = new Bitmap(numBlocks);
+        }
 
         size_t serialSize = BTreeNode<K, V>::getSerializedSize();
-        char* buffer = new char[serialSize];
-        memset(buffer, 0, serialSize);
+        vector<char> images(offsets.size() * serialSize);
+        for (size_t i = 0; i < offsets.size(); i++) {
+            shared_lock<shared_mutex> guard(latchFor(offsets[i]));
+            memcpy(images.data() + i * serialSize, mapBase + offsets[i], serialSize);
+        }
 
-        node.serialize(buffer);
+        if (wal != nullptr && !offsets.empty()) {
+            wal->sync();
+        }
 
-        file.seekp(offset, ios::beg);
-        file.write(buffer, serialSize);
-        file.flush();
+        for (size_t i = 0; i < offsets.size(); i++) {
+            ssize_t written = pwrite(fd, images.data() + i * serialSize, serialSize, static_cast<off_t>(offsets[i]));
+            if (written != static_cast<ssize_t>(serialSize)) {
+                throw runtime_error("Failed to write to disk");
+            }
+        }
+    }
 
-        if (file.fail()) {
-            delete[] buffer;
-            throw runtime_error("Failed to write to disk");
+    shared_mutex& latchFor(uint64_t offset) {
+        lock_guard<mutex> lock(latchTableMutex);
+
+        shared_mutex* latch;
+        if (!latches->find(offset, latch)) {
+            latch = new shared_mutex();
+            latches->insert(offset, latch);
         }
+        return *latch;
+    }
 
-        delete[] buffer;
+    void pinUpperLevels(const BTreeNode<K, V>& root) {
+        cache->unpinAll();
+        cache->pin(root.nodeOffset);
+
+        if (!root.isLeaf) {
+            for (uint32_t i = 0; i <= root.numKeys; i++) {
+                cache->pin(root.children[i]);
+            }
+        }
+    }
+
+    // Nodes fill whole pages; the first page holds the header.
+    static uint64_t slotSize() {
+        return BTreeNode<K, V>::getSerializedSize();
+    }
+
+    static size_t blockFor(uint64_t offset) {
+        return static_cast<size_t>(offset / slotSize());
+    }
+
+    static uint64_t offsetFor(size_t block) {
+        return block * slotSize();
+    }
+
+    // Marks every slot below nextFreeOffset as in use.
+    void resetFreeMap() {
+        size_t endBlock = blockFor(nextFreeOffset);
+
+        delete freeMap;
+        freeMap = new Bitmap(2 * endBlock);
+        for (size_t block = 1; block < endBlock; block++) {
+            freeMap->setBit(block);
+        }
+        freeSlots = 0;
+    }
+
+    // The saved free map lies at the slot allocateNode() hands out next, and
+    // it would also list a reused slot as free. Before either can be
+    // written, the header stops referring to the map. Caller holds
+    // allocMutex.
+    void dropSavedMap() {
+        uint64_t mapBlocks = 0;
+        off_t field = static_cast<off_t>(3 * sizeof(uint64_t) + 2 * sizeof(uint32_t));
+        if (pwrite(fd, &mapBlocks, sizeof(uint64_t), field) != static_cast<ssize_t>(sizeof(uint64_t))) {
+            throw runtime_error("Failed to save metadata");
+        }
+        fdatasync(fd);
+        mapSaved = false;
     }
 
     uint64_t allocateNode() {
+        lock_guard<mutex> lock(allocMutex);
+
+        if (mapSaved) {
+            dropSavedMap();
+        }
+
+        if (freeSlots > 0) {
+            size_t block = freeMap->findFreeBlock();
+            freeMap->setBit(block);
+            freeSlots--;
+            return offsetFor(block);
+        }
+
         uint64_t offset = nextFreeOffset;
-        size_t nodeSize = BTreeNode<K, V>::getSerializedSize();
-        nextFreeOffset = nextFreeOffset + nodeSize;
+        nextFreeOffset = nextFreeOffset + slotSize();
+
+        if (mapBase != nullptr && nextFreeOffset > fileBytes) {
+            if (ftruncate(fd, static_cast<off_t>(nextFreeOffset)) != 0) {
+                throw runtime_error("Failed to extend index file");
+            }
+            fileBytes = nextFreeOffset;
+            growMapping(nextFreeOffset);
+        }
 
-        if (nextFreeOffset % 64 != 0) {
-            nextFreeOffset = ((nextFreeOffset / 64) + 1) * 64;
+        size_t block = blockFor(offset);
+        if (block >= freeMap->getNumBlocks()) {
+            freeMap->resize(2 * block);
         }
+        freeMap->setBit(block);
 
         return offset;
     }
 
-    void splitChild(BTreeNode<K, V>& parent, uint32_t childIndex) {
+    // Callers drop the node from the cache first.
+    void freeNode(uint64_t offset) {
+        lock_guard<mutex> lock(allocMutex);
+
+        size_t block = blockFor(offset);
+        if (!freeMap->isFree(block)) {
+            freeMap->clearBit(block);
+            freeSlots++;
+        }
+    }
+
+    uint32_t findKeyIndex(const BTreeNode<K, V>& node, K key) const {
+        return NodeSearch<K>::lowerBound(node.keys, node.numKeys, key);
+    }
+
+    uint32_t findChildIndex(const BTreeNode<K, V>& node, K key) const {
+        return NodeSearch<K>::upperBound(node.keys, node.numKeys, key);
+    }
+
+    void splitChild(BTreeNode<K, V>& parent, uint32_t childIndex, Step& step) {
         uint64_t fullChildOffset = parent.children[childIndex];
         BTreeNode<K, V> fullChild = readNode(fullChildOffset);
 
-        if (fullChild.numKeys != 2 * BTREE_DEGREE - 1) {
+        if (fullChild.numKeys != 2 * DEGREE - 1) {
             throw runtime_error("Trying to split non-full child");
         }
 
         BTreeNode<K, V> newChild;
         newChild.isLeaf = fullChild.isLeaf;
-        newChild.numKeys = BTREE_DEGREE - 1;
+        newChild.numKeys = DEGREE - 1;
 
-        for (uint32_t j = 0; j < BTREE_DEGREE - 1; j++) {
-            newChild.keys[j] = fullChild.keys[j + BTREE_DEGREE];
-            newChild.values[j] = fullChild.values[j + BTREE_DEGREE];
-        }
+        uint64_t newChildOffset = allocateNode();
+        K separator;
 
-        if (!fullChild.isLeaf) {
-            for (uint32_t j = 0; j < BTREE_DEGREE; j++) {
-                newChild.children[j] = fullChild.children[j + BTREE_DEGREE];
+        if (fullChild.isLeaf) {
+            for (uint32_t j = 0; j < DEGREE - 1; j++) {
+                newChild.keys[j] = fullChild.keys[j + DEGREE];
+                newChild.values[j] = fullChild.values[j + DEGREE];
             }
+
+            fullChild.numKeys = DEGREE;
+            separator = newChild.keys[0];
+
+            newChild.nextLeaf = fullChild.nextLeaf;
+            fullChild.nextLeaf = newChildOffset;
         }
+        else {
+            for (uint32_t j = 0; j < DEGREE - 1; j++) {
+                newChild.keys[j] = fullChild.keys[j + DEGREE];
+            }
+            for (uint32_t j = 0; j < DEGREE; j++) {
+                newChild.children[j] = fullChild.children[j + DEGREE];
+            }
 
-        fullChild.numKeys = BTREE_DEGREE - 1;
+            fullChild.numKeys = DEGREE - 1;
+            separator = fullChild.keys[DEGREE - 1];
+        }
 
-        K midKey = fullChild.keys[BTREE_DEGREE - 1];
-        V midValue = fullChild.values[BTREE_DEGREE - 1];
+        writeNode(newChild, newChildOffset, step);
+        writeNode(fullChild, fullChildOffset, step);
 
-        uint64_t newChildOffset = allocateNode();
-        writeNode(newChild, newChildOffset);
-        writeNode(fullChild, fullChildOffset);
+        if (parent.nodeOffset == rootOffset) {
+            cache->pin(newChildOffset);
+        }
 
         for (int32_t j = parent.numKeys - 1; j >= static_cast<int32_t>(childIndex); j--) {
             parent.keys[j + 1] = parent.keys[j];
-            parent.values[j + 1] = parent.values[j];
         }
-        parent.keys[childIndex] = midKey;
-        parent.values[childIndex] = midValue;
+        parent.keys[childIndex] = separator;
 
         for (int32_t j = parent.numKeys; j >= static_cast<int32_t>(childIndex) + 1; j--) {
             parent.children[j + 1] = parent.children[j];
@@ -208,192 +691,392 @@ private:
         parent.numKeys++;
     }
 
-    void insertNonFull(uint64_t nodeOffset, K key, V value) {
-        BTreeNode<K, V> node = readNode(nodeOffset);
+    // Inserts below a node that is not full. The exclusive latch held in
+    // guard is handed down level by level and released at the leaf.
+    bool insertNonFull(BTreeNode<K, V> node, unique_lock<shared_mutex>& guard, K key, V value) {
+        while (!node.isLeaf) {
+            uint32_t i = findChildIndex(node, key);
 
-        if (node.isLeaf) {
-            for (uint32_t i = 0; i < node.numKeys; i++) {
-                if (node.keys[i] == key) {
-                    node.values[i] = value;
-                    writeNode(node, nodeOffset);
-                    return;
+            unique_lock<shared_mutex> childGuard(latchFor(node.children[i]));
+            BTreeNode<K, V> child = readNode(node.children[i]);
+
+            if (child.numKeys == 2 * DEGREE - 1) {
+                Step step;
+                splitChild(node, i, step);
+                writeNode(node, node.nodeOffset, step);
+                logStep(step, false);
+
+                if (!(key < node.keys[i])) {
+                    i++;
+                    unique_lock<shared_mutex> siblingGuard(latchFor(node.children[i]));
+                    childGuard.swap(siblingGuard);
                 }
+                child = readNode(node.children[i]);
             }
 
-            int32_t i = static_cast<int32_t>(node.numKeys) - 1;
-            while (i >= 0 && key < node.keys[i]) {
-                node.keys[i + 1] = node.keys[i];
-                node.values[i + 1] = node.values[i];
-                i--;
-            }
+            guard.swap(childGuard);
+            childGuard.unlock();
+            node = child;
+        }
 
-            node.keys[i + 1] = key;
-            node.values[i + 1] = value;
-            node.numKeys++;
+        uint32_t idx = findKeyIndex(node, key);
 
-            writeNode(node, nodeOffset);
+        Step step;
+        if (idx < node.numKeys && node.keys[idx] == key) {
+            node.values[idx] = value;
+            writeNode(node, node.nodeOffset, step);
+            logStep(step, false);
+            return false;
         }
-        else {
-            uint32_t i = 0;
-            while (i < node.numKeys && key > node.keys[i]) {
-                i++;
-            }
 
-            if (i < node.numKeys && key == node.keys[i]) {
-                node.values[i] = value;
-                writeNode(node, nodeOffset);
-                return;
-            }
+        for (uint32_t j = node.numKeys; j > idx; j--) {
+            node.keys[j] = node.keys[j - 1];
+            node.values[j] = node.values[j - 1];
+        }
 
-            uint64_t childOffset = node.children[i];
-            BTreeNode<K, V> child = readNode(childOffset);
+        node.keys[idx] = key;
+        node.values[idx] = value;
+        node.numKeys++;
 
-            if (child.numKeys == 2 * BTREE_DEGREE - 1) {
-                splitChild(node, i);
-                writeNode(node, nodeOffset);
+        writeNode(node, node.nodeOffset, step);
+        logStep(step, false);
+        return true;
+    }
 
-                node = readNode(nodeOffset);
-                if (key > node.keys[i]) {
-                    i++;
-                }
-                else if (key == node.keys[i]) {
-                    node.values[i] = value;
-                    writeNode(node, nodeOffset);
-                    return;
-                }
-            }
+    // Copies out the leaf covering key (or the leftmost leaf), crabbing
+    // shared latches on the way down.
+    bool findLeaf(K key, BTreeNode<K, V>& leaf, bool leftmost) {
+        shared_lock<shared_mutex> gate(treeLatch);
+        shared_lock<shared_mutex> rootGuard(rootLatch);
+        if (rootOffset == 0) {
+            return false;
+        }
 
-            insertNonFull(node.children[i], key, value);
+        uint64_t offset = rootOffset;
+        shared_lock<shared_mutex> guard(latchFor(offset));
+        rootGuard.unlock();
+
+        if (mapBase != nullptr) {
+            leaf = readNode(descendMapped(offset, guard, key, leftmost));
+            return true;
         }
-    }
 
-    bool searchInternal(uint64_t nodeOffset, K key, V& value) {
-        if (nodeOffset == 0) {
-            return false;
+        BTreeNode<K, V> node = readNode(offset);
+        while (!node.isLeaf) {
+            offset = leftmost ? node.children[0] : node.children[findChildIndex(node, key)];
+
+            shared_lock<shared_mutex> childGuard(latchFor(offset));
+            guard.swap(childGuard);
+            childGuard.unlock();
+
+            node = readNode(offset);
         }
 
-        BTreeNode<K, V> node = readNode(nodeOffset);
+        leaf = node;
+        return true;
+    }
+
+    // Crabs down from the latched node at offset to a leaf, reading each
+    // level in place. Returns the leaf, whose latch guard then holds.
+    uint64_t descendMapped(uint64_t offset, shared_lock<shared_mutex>& guard, K key, bool leftmost) {
+        BTreeNodeView<K, V> node(mappedNode(offset));
+        while (!node.isLeaf()) {
+            offset = leftmost ? node.childAt(0) : node.childAt(node.upperBound(key));
+
+            shared_lock<shared_mutex> childGuard(latchFor(offset));
+            guard.swap(childGuard);
+            childGuard.unlock();
 
-        uint32_t i = 0;
-        while (i < node.numKeys && key > node.keys[i]) {
-            i++;
+            node = BTreeNodeView<K, V>(mappedNode(offset));
         }
+        return offset;
+    }
 
-        if (i < node.numKeys && key == node.keys[i]) {
-            value = node.values[i];
+    // Point lookup in memory-mapped mode; only the value is copied out.
+    bool searchMapped(K key, V& value) {
+        shared_lock<shared_mutex> gate(treeLatch);
+        shared_lock<shared_mutex> rootGuard(rootLatch);
+        if (rootOffset == 0) {
+            return false;
+        }
+
+        uint64_t offset = rootOffset;
+        shared_lock<shared_mutex> guard(latchFor(offset));
+        rootGuard.unlock();
+
+        BTreeNodeView<K, V> leaf(mappedNode(descendMapped(offset, guard, key, false)));
+        uint32_t idx = leaf.lowerBound(key);
+        if (idx < leaf.numKeys() && leaf.keyAt(idx) == key) {
+            value = leaf.valueAt(idx);
             return true;
         }
+        return false;
+    }
 
-        if (node.isLeaf) {
+    // Follows a leaf link. Fails if a merge or borrow happened since the
+    // caller's copy was taken, since the link may then be stale or reused.
+    bool readLeaf(uint64_t offset, uint64_t version, BTreeNode<K, V>& leaf) {
+        shared_lock<shared_mutex> gate(treeLatch);
+        shared_lock<shared_mutex> guard(latchFor(offset));
+        if (structureVersion != version) {
             return false;
         }
+        leaf = readNode(offset);
+        return true;
+    }
+
+    // Header layout: rootOffset, nextFreeOffset, magic, format version, key
+    // count and the number of free map blocks, padded to METADATA_SIZE. The
+    // free map itself is written at nextFreeOffset, just past the last slot,
+    // and is dropped from the header before that slot is used.
+    // Caller holds allocMutex.
+    void encodeHeader(char* header, uint64_t mapBlocks) {
+        memset(header, 0, METADATA_SIZE);
 
-        return searchInternal(node.children[i], key, value);
+        uint64_t root = rootOffset;
+        uint64_t count = keyCount;
+        size_t offset = 0;
+        memcpy(header + offset, &root, sizeof(uint64_t));
+        offset = offset + sizeof(uint64_t);
+        memcpy(header + offset, &nextFreeOffset, sizeof(uint64_t));
+        offset = offset + sizeof(uint64_t);
+        memcpy(header + offset, &BTREE_MAGIC, sizeof(uint32_t));
+        offset = offset + sizeof(uint32_t);
+        memcpy(header + offset, &BTREE_FORMAT_VERSION, sizeof(uint32_t));
+        offset = offset + sizeof(uint32_t);
+        memcpy(header + offset, &count, sizeof(uint64_t));
+        offset = offset + sizeof(uint64_t);
+        memcpy(header + offset, &mapBlocks, sizeof(uint64_t));
     }
 
-    void traverseInternal(uint64_t nodeOffset, vector<pair<K, V>>& result) {
-        if (nodeOffset == 0) {
-            return;
+    // The header and free map describe pages that may only be in the log
+    // so far, so the log is synced first.
+    void saveMetadata() {
+        if (wal != nullptr) {
+            wal->sync();
+        }
+
+        lock_guard<mutex> lock(allocMutex);
+
+        uint64_t mapBlocks = blockFor(nextFreeOffset);
+        size_t mapBytes = (mapBlocks + 7) / 8;
+        char* mapBuffer = new char[freeMap->getByteSize()];
+        freeMap->serialize(mapBuffer);
+
+        ssize_t mapWritten = pwrite(fd, mapBuffer, mapBytes, static_cast<off_t>(nextFreeOffset));
+        delete[] mapBuffer;
+
+        if (mapWritten != static_cast<ssize_t>(mapBytes)) {
+            throw runtime_error("Failed to save free map");
         }
 
-        BTreeNode<K, V> node = readNode(nodeOffset);
+        char header[METADATA_SIZE];
+        encodeHeader(header, mapBlocks);
 
-        for (uint32_t i = 0; i < node.numKeys; i++) {
-            if (!node.isLeaf && node.children[i] != 0) {
-                traverseInternal(node.children[i], result);
+        if (pwrite(fd, header, METADATA_SIZE, 0) != static_cast<ssize_t>(METADATA_SIZE)) {
+            throw runtime_error("Failed to save metadata");
+        }
+        mapSaved = true;
+    }
+
+    void loadMetadata() {
+        char header[METADATA_SIZE];
+        memset(header, 0, METADATA_SIZE);
+
+        if (pread(fd, header, METADATA_SIZE, 0) < 0) {
+            throw runtime_error("Failed to read metadata");
+        }
+
+        uint64_t root;
+        uint64_t count;
+        uint64_t mapBlocks;
+        uint32_t magic;
+        uint32_t version;
+        size_t offset = 0;
+        memcpy(&root, header + offset, sizeof(uint64_t));
+        offset = offset + sizeof(uint64_t);
+        memcpy(&nextFreeOffset, header + offset, sizeof(uint64_t));
+        offset = offset + sizeof(uint64_t);
+        memcpy(&magic, header + offset, sizeof(uint32_t));
+        offset = offset + sizeof(uint32_t);
+        memcpy(&version, header + offset, sizeof(uint32_t));
+        offset = offset + sizeof(uint32_t);
+        memcpy(&count, header + offset, sizeof(uint64_t));
+        offset = offset + sizeof(uint64_t);
+        memcpy(&mapBlocks, header + offset, sizeof(uint64_t));
+
+        rootOffset = root;
+        keyCount = count;
+        mapSaved = mapBlocks != 0;
+
+        if (magic != BTREE_MAGIC || version != BTREE_FORMAT_VERSION) {
+            if (rootOffset != 0) {
+                throw runtime_error("Unsupported index file format: " + indexFile);
             }
-            result.push_back(make_pair(node.keys[i], node.values[i]));
+            keyCount = 0;
         }
 
-        if (!node.isLeaf && node.children[node.numKeys] != 0) {
-            traverseInternal(node.children[node.numKeys], result);
+        if (rootOffset == 0) {
+            keyCount = 0;
         }
+
+        if (nextFreeOffset < slotSize()) {
+            nextFreeOffset = slotSize();
+        }
+
+        // Files written before the free map existed have no map; all their
+        // slots are treated as in use.
+        resetFreeMap();
+        if (mapBlocks == 0 || mapBlocks != blockFor(nextFreeOffset)) {
+            return;
+        }
+
+        size_t mapBytes = (mapBlocks + 7) / 8;
+        char* mapBuffer = new char[freeMap->getByteSize()];
+        memset(mapBuffer, 0, freeMap->getByteSize());
+
+        ssize_t mapRead = pread(fd, mapBuffer, mapBytes, static_cast<off_t>(nextFreeOffset));
+        if (mapRead == static_cast<ssize_t>(mapBytes)) {
+            freeMap->deserialize(mapBuffer);
+            freeMap->setBit(0);
+            // Blocks from mapBlocks on are past the end of the file.
+            freeSlots = freeMap->countFree() - (freeMap->getNumBlocks() - mapBlocks);
+        }
+        delete[] mapBuffer;
     }
 
-    void saveMetadata() {
-        file.seekp(0, ios::beg);
-        file.write(reinterpret_cast<const char*>(&rootOffset), sizeof(uint64_t));
-        file.write(reinterpret_cast<const char*>(&nextFreeOffset), sizeof(uint64_t));
-        file.flush();
+    // Files written before the versioned header start with only rootOffset
+    // and nextFreeOffset, so a nonzero root without the magic marks one.
+    bool isLegacyFile() {
+        char header[METADATA_SIZE];
+        memset(header, 0, METADATA_SIZE);
 
-        if (file.fail()) {
-            throw runtime_error("Failed to save metadata");
+        if (pread(fd, header, METADATA_SIZE, 0) < 0) {
+            throw runtime_error("Failed to read metadata");
         }
+
+        uint64_t root;
+        uint32_t magic;
+        memcpy(&root, header, sizeof(uint64_t));
+        memcpy(&magic, header + 2 * sizeof(uint64_t), sizeof(uint32_t));
+        return root != 0 && magic != BTREE_MAGIC;
     }
 
-    void loadMetadata() {
-        file.seekg(0, ios::beg);
-        file.read(reinterpret_cast<char*>(&rootOffset), sizeof(uint64_t));
-        file.read(reinterpret_cast<char*>(&nextFreeOffset), sizeof(uint64_t));
+    // Appends the pairs under a legacy node in key order. Legacy trees are
+    // plain B-trees of BTREE_LEGACY_DEGREE with values at every level and
+    // packed nodes: leaf flag, key count, then full key, value and child
+    // arrays. A key stored twice keeps the copy nearest the root, which is
+    // the one a lookup found.
+    void readLegacyPairs(uint64_t offset, uint32_t depth, vector<pair<K, V>>& pairs, vector<uint32_t>& depths) {
+        const size_t maxKeys = 2 * BTREE_LEGACY_DEGREE - 1;
+        size_t keysAt = 1 + sizeof(uint32_t);
+        size_t valuesAt = keysAt + sizeof(K) * maxKeys;
+        size_t childrenAt = valuesAt + sizeof(uint64_t) * maxKeys;
+        size_t nodeSize = childrenAt + sizeof(uint64_t) * (maxKeys + 1) + sizeof(uint64_t);
+
+        vector<char> buffer(nodeSize);
+        if (offset == 0 || depth > BTREE_LEGACY_DEGREE ||
+            pread(fd, buffer.data(), nodeSize, static_cast<off_t>(offset)) != static_cast<ssize_t>(nodeSize)) {
+            throw runtime_error("Corrupt legacy index file: " + indexFile);
+        }
 
-        if (file.fail()) {
-            file.clear();
-            rootOffset = 0;
-            nextFreeOffset = METADATA_SIZE;
+        bool isLeaf = buffer[0] == 1;
+        uint32_t numKeys;
+        memcpy(&numKeys, buffer.data() + 1, sizeof(uint32_t));
+        if (numKeys > maxKeys) {
+            throw runtime_error("Corrupt legacy index file: " + indexFile);
+        }
+
+        for (uint32_t i = 0; i <= numKeys; i++) {
+            if (!isLeaf) {
+                uint64_t child;
+                memcpy(&child, buffer.data() + childrenAt + i * sizeof(uint64_t), sizeof(uint64_t));
+                readLegacyPairs(child, depth + 1, pairs, depths);
+            }
+            if (i == numKeys) {
+                break;
+            }
+
+            K key;
+            uint64_t value;
+            memcpy(&key, buffer.data() + keysAt + i * sizeof(K), sizeof(K));
+            memcpy(&value, buffer.data() + valuesAt + i * sizeof(uint64_t), sizeof(uint64_t));
+
+            if (!pairs.empty() && pairs.back().first == key) {
+                if (depth < depths.back()) {
+                    pairs.back().second = legacyValue<V>(value);
+                    depths.back() = depth;
+                }
+            }
+            else {
+                pairs.push_back(make_pair(key, legacyValue<V>(value)));
+                depths.push_back(depth);
+            }
         }
+    }
 
-        if (nextFreeOffset < METADATA_SIZE) {
-            nextFreeOffset = METADATA_SIZE;
+    // Rewrites a legacy file in the current format through a bulk load into
+    // a copy, which then replaces it as in compact().
+    void migrateLegacyFile() {
+        uint64_t root;
+        if (pread(fd, &root, sizeof(uint64_t), 0) != static_cast<ssize_t>(sizeof(uint64_t))) {
+            throw runtime_error("Failed to read metadata");
         }
-    }
 
-    void getPredecessor(uint64_t nodeOffset, uint32_t idx, K& predKey, V& predValue) {
-        BTreeNode<K, V> node = readNode(nodeOffset);
-        uint64_t current = node.children[idx];
+        vector<pair<K, V>> pairs;
+        vector<uint32_t> depths;
+        readLegacyPairs(root, 0, pairs, depths);
 
-        while (true) {
-            BTreeNode<K, V> crnt = readNode(current);
-            if (crnt.isLeaf) {
-                predKey = crnt.keys[crnt.numKeys - 1];
-                predValue = crnt.values[crnt.numKeys - 1];
-                return;
-            }
-            current = crnt.children[crnt.numKeys];
+        string migrateFile = indexFile + ".migrate";
+        unlink(migrateFile.c_str());
+        {
+            BTree<K, V> current(migrateFile);
+            current.bulkLoad(pairs, BTREE_BULK_FILL_FACTOR);
         }
-    }
 
-    void getSuccessor(uint64_t nodeOffset, uint32_t idx, K& succKey, V& succValue) {
-        BTreeNode<K, V> node = readNode(nodeOffset);
-        uint64_t current = node.children[idx + 1];
+        if (rename(migrateFile.c_str(), indexFile.c_str()) != 0) {
+            throw runtime_error("Failed to replace index file with migrated copy");
+        }
 
-        while (true) {
-            BTreeNode<K, V> crnt = readNode(current);
-            if (crnt.isLeaf) {
-                succKey = crnt.keys[0];
-                succValue = crnt.values[0];
-                return;
-            }
-            current = crnt.children[0];
+        ::close(fd);
+        fd = open(indexFile.c_str(), O_RDWR);
+        if (fd < 0) {
+            throw runtime_error("Failed to open index file");
         }
     }
 
-    void merge(BTreeNode<K, V>& parent, uint32_t idx) {
+    void merge(BTreeNode<K, V>& parent, uint32_t idx, Step& step) {
+        structureVersion++;
+
         uint64_t leftChildOffset = parent.children[idx];
         uint64_t rightChildOffset = parent.children[idx + 1];
 
         BTreeNode<K, V> leftChild = readNode(leftChildOffset);
         BTreeNode<K, V> rightChild = readNode(rightChildOffset);
 
-        leftChild.keys[leftChild.numKeys] = parent.keys[idx];
-        leftChild.values[leftChild.numKeys] = parent.values[idx];
-        leftChild.numKeys++;
-
-        for (uint32_t i = 0; i < rightChild.numKeys; i++) {
-            leftChild.keys[leftChild.numKeys + i] = rightChild.keys[i];
-            leftChild.values[leftChild.numKeys + i] = rightChild.values[i];
+        if (leftChild.isLeaf) {
+            for (uint32_t i = 0; i < rightChild.numKeys; i++) {
+                leftChild.keys[leftChild.numKeys + i] = rightChild.keys[i];
+                leftChild.values[leftChild.numKeys + i] = rightChild.values[i];
+            }
+            leftChild.numKeys += rightChild.numKeys;
+            leftChild.nextLeaf = rightChild.nextLeaf;
         }
+        else {
+            leftChild.keys[leftChild.numKeys] = parent.keys[idx];
+            leftChild.numKeys++;
 
-        if (!leftChild.isLeaf) {
+            for (uint32_t i = 0; i < rightChild.numKeys; i++) {
+                leftChild.keys[leftChild.numKeys + i] = rightChild.keys[i];
+            }
             for (uint32_t i = 0; i <= rightChild.numKeys; i++) {
                 leftChild.children[leftChild.numKeys + i] = rightChild.children[i];
             }
+            leftChild.numKeys += rightChild.numKeys;
         }
 
-        leftChild.numKeys += rightChild.numKeys;
-
         for (uint32_t i = idx; i < parent.numKeys - 1; i++) {
             parent.keys[i] = parent.keys[i + 1];
-            parent.values[i] = parent.values[i + 1];
         }
 
         for (uint32_t i = idx + 1; i < parent.numKeys; i++) {
@@ -402,11 +1085,15 @@ private:
 
         parent.numKeys--;
 
-        writeNode(leftChild, leftChildOffset);
-        writeNode(parent, parent.nodeOffset);
+        writeNode(leftChild, leftChildOffset, step);
+        writeNode(parent, parent.nodeOffset, step);
+        cache->erase(rightChildOffset);
+        freeNode(rightChildOffset);
     }
 
-    void borrowFromLeft(BTreeNode<K, V>& parent, uint32_t idx) {
+    void borrowFromLeft(BTreeNode<K, V>& parent, uint32_t idx, Step& step) {
+        structureVersion++;
+
         uint64_t childOffset = parent.children[idx];
         uint64_t leftSiblingOffset = parent.children[idx - 1];
 
@@ -418,45 +1105,46 @@ private:
             child.values[i + 1] = child.values[i];
         }
 
-        if (!child.isLeaf) {
+        if (child.isLeaf) {
+            child.keys[0] = leftSibling.keys[leftSibling.numKeys - 1];
+            child.values[0] = leftSibling.values[leftSibling.numKeys - 1];
+            parent.keys[idx - 1] = child.keys[0];
+        }
+        else {
             for (int32_t i = child.numKeys; i >= 0; i--) {
                 child.children[i + 1] = child.children[i];
             }
-        }
-
-        child.keys[0] = parent.keys[idx - 1];
-        child.values[0] = parent.values[idx - 1];
 
-        parent.keys[idx - 1] = leftSibling.keys[leftSibling.numKeys - 1];
-        parent.values[idx - 1] = leftSibling.values[leftSibling.numKeys - 1];
-
-        if (!child.isLeaf) {
+            child.keys[0] = parent.keys[idx - 1];
             child.children[0] = leftSibling.children[leftSibling.numKeys];
+            parent.keys[idx - 1] = leftSibling.keys[leftSibling.numKeys - 1];
         }
 
         child.numKeys++;
         leftSibling.numKeys--;
 
-        writeNode(child, childOffset);
-        writeNode(leftSibling, leftSiblingOffset);
-        writeNode(parent, parent.nodeOffset);
+        writeNode(child, childOffset, step);
+        writeNode(leftSibling, leftSiblingOffset, step);
+        writeNode(parent, parent.nodeOffset, step);
     }
 
-    void borrowFromRight(BTreeNode<K, V>& parent, uint32_t idx) {
+    void borrowFromRight(BTreeNode<K, V>& parent, uint32_t idx, Step& step) {
+        structureVersion++;
+
         uint64_t childOffset = parent.children[idx];
         uint64_t rightSiblingOffset = parent.children[idx + 1];
 
         BTreeNode<K, V> child = readNode(childOffset);
         BTreeNode<K, V> rightSibling = readNode(rightSiblingOffset);
 
-        child.keys[child.numKeys] = parent.keys[idx];
-        child.values[child.numKeys] = parent.values[idx];
-
-        parent.keys[idx] = rightSibling.keys[0];
-        parent.values[idx] = rightSibling.values[0];
-
-        if (!child.isLeaf) {
+        if (child.isLeaf) {
+            child.keys[child.numKeys] = rightSibling.keys[0];
+            child.values[child.numKeys] = rightSibling.values[0];
+        }
+        else {
+            child.keys[child.numKeys] = parent.keys[idx];
             child.children[child.numKeys + 1] = rightSibling.children[0];
+            parent.keys[idx] = rightSibling.keys[0];
         }
 
         child.numKeys++;
@@ -474,33 +1162,48 @@ private:
 
         rightSibling.numKeys--;
 
-        writeNode(child, childOffset);
-        writeNode(rightSibling, rightSiblingOffset);
-        writeNode(parent, parent.nodeOffset);
+        if (child.isLeaf) {
+            parent.keys[idx] = rightSibling.keys[0];
+        }
+
+        writeNode(child, childOffset, step);
+        writeNode(rightSibling, rightSiblingOffset, step);
+        writeNode(parent, parent.nodeOffset, step);
     }
 
-    void fill(BTreeNode<K, V>& parent, uint32_t idx) {
+    // Called with the parent latched exclusively. Latches the two children
+    // involved left to right, the same order a split uses, and leaves them
+    // with the step.
+    void fill(BTreeNode<K, V>& parent, uint32_t idx, Step& step) {
         if (idx != 0) {
+            unique_lock<shared_mutex> leftGuard(latchFor(parent.children[idx - 1]));
+            unique_lock<shared_mutex> childGuard(latchFor(parent.children[idx]));
+
             BTreeNode<K, V> leftSibling = readNode(parent.children[idx - 1]);
-            if (leftSibling.numKeys >= BTREE_DEGREE) {
-                borrowFromLeft(parent, idx);
+            if (leftSibling.numKeys >= DEGREE || idx == parent.numKeys) {
+                step.hold(leftGuard);
+                step.hold(childGuard);
+                if (leftSibling.numKeys >= DEGREE) {
+                    borrowFromLeft(parent, idx, step);
+                }
+                else {
+                    merge(parent, idx - 1, step);
+                }
                 return;
             }
         }
 
-        if (idx != parent.numKeys) {
-            BTreeNode<K, V> rightSibling = readNode(parent.children[idx + 1]);
-            if (rightSibling.numKeys >= BTREE_DEGREE) {
-                borrowFromRight(parent, idx);
-                return;
-            }
-        }
+        unique_lock<shared_mutex> childGuard(latchFor(parent.children[idx]));
+        unique_lock<shared_mutex> rightGuard(latchFor(parent.children[idx + 1]));
+        step.hold(childGuard);
+        step.hold(rightGuard);
 
-        if (idx != parent.numKeys) {
-            merge(parent, idx);
+        BTreeNode<K, V> rightSibling = readNode(parent.children[idx + 1]);
+        if (rightSibling.numKeys >= DEGREE) {
+            borrowFromRight(parent, idx, step);
         }
         else {
-            merge(parent, idx - 1);
+            merge(parent, idx, step);
         }
     }
 
@@ -512,124 +1215,490 @@ private:
         node.numKeys--;
     }
 
-    void removeFromNonLeaf(BTreeNode<K, V>& node, uint32_t idx) {
-        K key = node.keys[idx];
-        uint64_t nodeOffset = node.nodeOffset;
+public:
+    // Walks the leaf chain one leaf copy at a time. If the tree is
+    // restructured under it, the iterator re-seeks past the last key seen.
+    class Iterator {
+    private:
+        BTree<K, V>* tree;
+        BTreeNode<K, V> leaf;
+        uint32_t pos;
+        bool bounded;
+        K upper;
+        bool hasStart;
+        K start;
+        bool hasLast;
+        K last;
+        uint64_t version;
+
+        bool seek() {
+            version = tree->structureVersion;
+
+            if (hasLast) {
+                if (!tree->findLeaf(last, leaf, false)) {
+                    return false;
+                }
+                pos = tree->findChildIndex(leaf, last);
+            }
+            else {
+                if (!tree->findLeaf(start, leaf, !hasStart)) {
+                    return false;
+                }
+                pos = hasStart ? tree->findKeyIndex(leaf, start) : 0;
+            }
+            return true;
+        }
 
-        uint64_t leftChildOffset = node.children[idx];
-        uint64_t rightChildOffset = node.children[idx + 1];
+        void settle() {
+            while (leaf.nodeOffset != 0 && pos >= leaf.numKeys) {
+                if (leaf.nextLeaf == 0) {
+                    leaf.nodeOffset = 0;
+                    break;
+                }
 
-        BTreeNode<K, V> leftChild = readNode(leftChildOffset);
-        BTreeNode<K, V> rightChild = readNode(rightChildOffset);
+                if (tree->readLeaf(leaf.nextLeaf, version, leaf)) {
+                    pos = 0;
+                }
+                else if (!seek()) {
+                    leaf.nodeOffset = 0;
+                }
+            }
 
-        if (leftChild.numKeys >= BTREE_DEGREE) {
-            K predKey;
-            V predValue;
-            getPredecessor(nodeOffset, idx, predKey, predValue);
-            node.keys[idx] = predKey;
-            node.values[idx] = predValue;
-            writeNode(node, nodeOffset);
-            removeInternal(leftChildOffset, predKey);
-        }
-        else if (rightChild.numKeys >= BTREE_DEGREE) {
-            K succKey;
-            V succValue;
-            getSuccessor(nodeOffset, idx, succKey, succValue);
-            node.keys[idx] = succKey;
-            node.values[idx] = succValue;
-            writeNode(node, nodeOffset);
-            removeInternal(rightChildOffset, succKey);
+            if (leaf.nodeOffset != 0 && bounded && upper < leaf.keys[pos]) {
+                leaf.nodeOffset = 0;
+            }
         }
-        else {
-            merge(node, idx);
-            writeNode(node, nodeOffset);
-            removeInternal(leftChildOffset, key);
+
+    public:
+        Iterator() : tree(nullptr), pos(0), bounded(false), upper(), hasStart(false), start(),
+            hasLast(false), last(), version(0) {}
+
+        Iterator(BTree<K, V>* t, bool hasStartKey, K startKey, bool hasUpper, K upperKey)
+            : tree(t), pos(0), bounded(hasUpper), upper(upperKey), hasStart(hasStartKey),
+            start(startKey), hasLast(false), last(), version(0) {
+            if (seek()) {
+                settle();
+            }
+            else {
+                leaf.nodeOffset = 0;
+            }
         }
-    }
 
-    bool removeInternal(uint64_t nodeOffset, K key) {
-        if (nodeOffset == 0) {
-            return false;
+        pair<K, V> operator*() const {
+            return make_pair(leaf.keys[pos], leaf.values[pos]);
+        }
+
+        K key() const {
+            return leaf.keys[pos];
+        }
+
+        V value() const {
+            return leaf.values[pos];
         }
 
-        BTreeNode<K, V> node = readNode(nodeOffset);
+        Iterator& operator++() {
+            last = leaf.keys[pos];
+            hasLast = true;
+            pos++;
+            settle();
+            return *this;
+        }
+
+        bool atEnd() const {
+            return leaf.nodeOffset == 0;
+        }
+
+        bool operator==(const Iterator& other) const {
+            if (atEnd() || other.atEnd()) {
+                return atEnd() == other.atEnd();
+            }
+            return leaf.nodeOffset == other.leaf.nodeOffset && pos == other.pos;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return !(*this == other);
+        }
+    };
+
+    struct Range {
+        Iterator first;
+        Iterator last;
+
+        Iterator begin() const {
+            return first;
+        }
+
+        Iterator end() const {
+            return last;
+        }
+    };
+
+    // Builds an empty tree bottom-up from keys supplied in strictly ascending
+    // order. Nodes are packed to the fill factor and written sequentially;
+    // each level keeps one finished node back so the last two nodes can be
+    // rebalanced in finish().
+    class BulkLoader {
+    private:
+        struct Level {
+            BTreeNode<K, V> pending;
+            BTreeNode<K, V> current;
+            K pendingMin;
+            K currentMin;
+            bool hasPending;
+            bool hasCurrent;
+
+            Level() : pendingMin(), currentMin(), hasPending(false), hasCurrent(false) {}
+        };
+
+        BTree<K, V>* tree;
+        vector<Level> levels;
+        uint32_t leafCapacity;
+        uint32_t innerCapacity;
+        uint64_t count;
+        K lastKey;
+        bool finished;
+
+        void startNode(size_t level, bool isLeaf) {
+            levels[level].current = BTreeNode<K, V>();
+            levels[level].current.isLeaf = isLeaf;
+            levels[level].current.nodeOffset = tree->allocateNode();
+            levels[level].hasCurrent = true;
+        }
+
+        void writeOut(size_t level, BTreeNode<K, V>& node, K minKey) {
+            tree->writeNodeToDisk(node, node.nodeOffset);
+            addChild(level + 1, minKey, node.nodeOffset);
+        }
 
-        uint32_t idx = 0;
-        while (idx < node.numKeys && key > node.keys[idx]) {
-            idx++;
+        void completeCurrent(size_t level) {
+            if (levels[level].hasPending) {
+                Level& l = levels[level];
+                if (l.pending.isLeaf) {
+                    l.pending.nextLeaf = l.current.nodeOffset;
+                }
+                BTreeNode<K, V> node = l.pending;
+                writeOut(level, node, l.pendingMin);
+            }
+
+            levels[level].pending = levels[level].current;
+            levels[level].pendingMin = levels[level].currentMin;
+            levels[level].hasPending = true;
+            levels[level].hasCurrent = false;
+        }
+
+        void addChild(size_t level, K minKey, uint64_t childOffset) {
+            if (levels.size() <= level) {
+                levels.resize(level + 1);
+            }
+
+            if (levels[level].hasCurrent && levels[level].current.numKeys == innerCapacity) {
+                completeCurrent(level);
+            }
+
+            if (!levels[level].hasCurrent) {
+                startNode(level, false);
+                levels[level].current.children[0] = childOffset;
+                levels[level].currentMin = minKey;
+                return;
+            }
+
+            BTreeNode<K, V>& node = levels[level].current;
+            node.keys[node.numKeys] = minKey;
+            node.children[node.numKeys + 1] = childOffset;
+            node.numKeys++;
         }
 
-        if (idx < node.numKeys && key == node.keys[idx]) {
-            if (node.isLeaf) {
-                removeFromLeaf(node, idx);
-                writeNode(node, nodeOffset);
+        // Merges or evens out the last two nodes of a level so the rightmost
+        // node is not left below the minimum occupancy.
+        bool rebalanceTail(Level& l) {
+            BTreeNode<K, V>& left = l.pending;
+            BTreeNode<K, V>& right = l.current;
+            const uint32_t maxKeys = 2 * DEGREE - 1;
+
+            if (left.isLeaf) {
+                uint32_t total = left.numKeys + right.numKeys;
+                if (total <= maxKeys) {
+                    for (uint32_t i = 0; i < right.numKeys; i++) {
+                        left.keys[left.numKeys + i] = right.keys[i];
+                        left.values[left.numKeys + i] = right.values[i];
+                    }
+                    left.numKeys = total;
+                    return false;
+                }
+                if (right.numKeys >= DEGREE - 1) {
+                    return true;
+                }
+
+                uint32_t leftCount = total / 2;
+                uint32_t moved = left.numKeys - leftCount;
+                for (int32_t i = static_cast<int32_t>(right.numKeys) - 1; i >= 0; i--) {
+                    right.keys[i + moved] = right.keys[i];
+                    right.values[i + moved] = right.values[i];
+                }
+                for (uint32_t i = 0; i < moved; i++) {
+                    right.keys[i] = left.keys[leftCount + i];
+                    right.values[i] = left.values[leftCount + i];
+                }
+                left.numKeys = leftCount;
+                right.numKeys = total - leftCount;
+                l.currentMin = right.keys[0];
                 return true;
             }
-            else {
-                removeFromNonLeaf(node, idx);
+
+            uint32_t total = left.numKeys + 1 + right.numKeys;
+            if (total <= maxKeys) {
+                left.keys[left.numKeys] = l.currentMin;
+                for (uint32_t i = 0; i < right.numKeys; i++) {
+                    left.keys[left.numKeys + 1 + i] = right.keys[i];
+                }
+                for (uint32_t i = 0; i <= right.numKeys; i++) {
+                    left.children[left.numKeys + 1 + i] = right.children[i];
+                }
+                left.numKeys = total;
+                return false;
+            }
+            if (right.numKeys >= DEGREE - 1) {
                 return true;
             }
+
+            vector<K> keys(left.keys, left.keys + left.numKeys);
+            keys.push_back(l.currentMin);
+            keys.insert(keys.end(), right.keys, right.keys + right.numKeys);
+
+            vector<uint64_t> children(left.children, left.children + left.numKeys + 1);
+            children.insert(children.end(), right.children, right.children + right.numKeys + 1);
+
+            uint32_t leftCount = total / 2;
+            left.numKeys = leftCount;
+            right.numKeys = total - leftCount - 1;
+            for (uint32_t i = 0; i < right.numKeys; i++) {
+                right.keys[i] = keys[leftCount + 1 + i];
+            }
+            for (uint32_t i = 0; i <= right.numKeys; i++) {
+                right.children[i] = children[leftCount + 1 + i];
+            }
+            l.currentMin = keys[leftCount];
+            return true;
         }
 
-        if (node.isLeaf) {
-            return false;
+    public:
+        BulkLoader(BTree<K, V>* t, float fillFactor)
+            : tree(t), count(0), lastKey(), finished(false) {
+            if (!tree->isEmpty()) {
+                throw runtime_error("Bulk load requires an empty tree");
+            }
+
+            const uint32_t maxKeys = 2 * DEGREE - 1;
+            uint32_t capacity = static_cast<uint32_t>(fillFactor * maxKeys + 0.5f);
+            if (capacity < DEGREE) {
+                capacity = DEGREE;
+            }
+            if (capacity > maxKeys) {
+                capacity = maxKeys;
+            }
+            leafCapacity = capacity;
+            innerCapacity = capacity;
+
+            tree->cache->clear();
+            if (tree->mapBase != nullptr) {
+                tree->remapFile();
+            }
+            tree->saveMetadata();
+            tree->markRewritten();
+            levels.resize(1);
         }
 
-        bool isInSubtree = (idx < node.numKeys);
+        void add(K key, V value) {
+            if (finished) {
+                throw runtime_error("Bulk load already finished");
+            }
+            if (count > 0 && !(lastKey < key)) {
+                throw runtime_error("Bulk load keys must be strictly ascending");
+            }
+
+            if (levels[0].hasCurrent && levels[0].current.numKeys == leafCapacity) {
+                completeCurrent(0);
+            }
+            if (!levels[0].hasCurrent) {
+                startNode(0, true);
+                levels[0].currentMin = key;
+            }
+
+            BTreeNode<K, V>& leaf = levels[0].current;
+            leaf.keys[leaf.numKeys] = key;
+            leaf.values[leaf.numKeys] = value;
+            leaf.numKeys++;
 
-        BTreeNode<K, V> child = readNode(node.children[idx]);
-        if (child.numKeys < BTREE_DEGREE) {
-            fill(node, idx);
-            node = readNode(nodeOffset);
+            lastKey = key;
+            count++;
+        }
+
+        void add(K key) {
+            add(key, V());
+        }
 
-            idx = 0;
-            while (idx < node.numKeys && key > node.keys[idx]) {
-                idx++;
+        void finish() {
+            if (finished) {
+                return;
             }
+            finished = true;
 
-            if (idx < node.numKeys && key == node.keys[idx]) {
-                if (node.isLeaf) {
-                    removeFromLeaf(node, idx);
-                    writeNode(node, nodeOffset);
-                    return true;
+            BTreeNode<K, V> root;
+            for (size_t level = 0; level < levels.size(); level++) {
+                if (!levels[level].hasCurrent) {
+                    break;
                 }
-                else {
-                    removeFromNonLeaf(node, idx);
-                    return true;
+
+                if (!levels[level].hasPending && level + 1 == levels.size()) {
+                    root = levels[level].current;
+                    tree->writeNodeToDisk(root, root.nodeOffset);
+                    tree->rootOffset = root.nodeOffset;
+                    break;
+                }
+
+                bool keepRight = rebalanceTail(levels[level]);
+
+                BTreeNode<K, V> left = levels[level].pending;
+                BTreeNode<K, V> right = levels[level].current;
+                K leftMin = levels[level].pendingMin;
+                K rightMin = levels[level].currentMin;
+
+                if (left.isLeaf) {
+                    left.nextLeaf = keepRight ? right.nodeOffset : 0;
+                }
+
+                if (!keepRight && level + 1 == levels.size()) {
+                    root = left;
+                    tree->writeNodeToDisk(root, root.nodeOffset);
+                    tree->rootOffset = root.nodeOffset;
+                    break;
+                }
+
+                writeOut(level, left, leftMin);
+                if (keepRight) {
+                    writeOut(level, right, rightMin);
                 }
             }
+
+            tree->keyCount = count;
+            fdatasync(tree->fd);
+            tree->saveMetadata();
+            fdatasync(tree->fd);
+            if (tree->rootOffset != 0) {
+                tree->pinUpperLevels(root);
+            }
         }
+    };
 
-        return removeInternal(node.children[idx], key);
+    BulkLoader bulkLoader(float fillFactor = 1.0f) {
+        return BulkLoader(this, fillFactor);
     }
 
-public:
-    BTree(const string& filename) : indexFile(filename), rootOffset(0), nextFreeOffset(METADATA_SIZE) {
-        file.open(indexFile, ios::in | ios::out | ios::binary);
+    void bulkLoad(const vector<pair<K, V>>& sortedPairs, float fillFactor = 1.0f) {
+        BulkLoader loader(this, fillFactor);
+        for (const auto& p : sortedPairs) {
+            loader.add(p.first, p.second);
+        }
+        loader.finish();
+    }
 
-        if (!file.is_open()) {
-            file.open(indexFile, ios::out | ios::binary);
-            if (!file.is_open()) {
-                throw runtime_error("Failed to create index file");
-            }
+    BTree(const string& filename, size_t cachePages = BTREE_CACHE_PAGES, bool mapped = BTREE_MEMORY_MAPPED)
+        : rootOffset(0), indexFile(filename), fd(-1), nextFreeOffset(slotSize()), keyCount(0),
+        structureVersion(0), freeMap(nullptr), freeSlots(0), mapSaved(false), wal(nullptr), walTarget(0),
+        memoryMapped(mapped), mapBase(nullptr), mappedBytes(0), fileBytes(0), dirtyMap(nullptr) {
+        latches = new HashTable<uint64_t, shared_mutex*>(HASH_TABLE_SIZE);
+        // The mapping replaces the cache, which is kept minimal.
+        cache = new PageCache<BTreeNode<K, V>>(memoryMapped ? 1 : cachePages,
+            [this](uint64_t offset, const BTreeNode<K, V>& node) {
+                if (wal != nullptr) {
+                    wal->sync();
+                }
+                writeNodeToDisk(node, offset);
+            });
+
+        fd = open(indexFile.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open index file");
+        }
+
+        if (isLegacyFile()) {
+            migrateLegacyFile();
+        }
+
+        loadMetadata();
+        if (memoryMapped) {
+            mapFile();
+        }
+
+        if (rootOffset == 0) {
             saveMetadata();
-            file.close();
+        }
+        else {
+            pinUpperLevels(readNode(rootOffset));
+        }
+    }
 
-            file.open(indexFile, ios::in | ios::out | ios::binary);
-            if (!file.is_open()) {
-                throw runtime_error("Failed to open index file");
+    // Logs every later change to the tree. If startup replay wrote into
+    // this file, the header may predate some replayed nodes, so the end of
+    // the file and the key count are recomputed and the free map dropped.
+    void attachLog(WriteAheadLog* log) {
+        unique_lock<shared_mutex> gate(treeLatch);
+
+        wal = log;
+        walTarget = wal->registerTarget(indexFile);
+        if (!wal->wasRecovered(indexFile)) {
+            return;
+        }
+
+        cache->clear();
+        loadMetadata();
+
+        off_t fileSize = lseek(fd, 0, SEEK_END);
+        if (fileSize > static_cast<off_t>(slotSize())) {
+            uint64_t end = ((static_cast<uint64_t>(fileSize) + slotSize() - 1) / slotSize()) * slotSize();
+            if (end > nextFreeOffset) {
+                nextFreeOffset = end;
             }
         }
-        else {
-            loadMetadata();
+        resetFreeMap();
+
+        uint64_t count = 0;
+        if (rootOffset != 0) {
+            BTreeNode<K, V> node = readNode(rootOffset);
+            while (!node.isLeaf) {
+                node = readNode(node.children[0]);
+            }
+            while (true) {
+                count = count + node.numKeys;
+                if (node.nextLeaf == 0) {
+                    break;
+                }
+                node = readNode(node.nextLeaf);
+            }
+            pinUpperLevels(readNode(rootOffset));
         }
+        keyCount = count;
+
+        saveMetadata();
+        fdatasync(fd);
     }
 
     ~BTree() {
         close();
+        delete cache;
+        delete freeMap;
+        delete dirtyMap;
+
+        latches->forEach([](uint64_t, shared_mutex* latch) {
+            delete latch;
+        });
+        delete latches;
     }
 
     void insert(K key, V value) {
+        shared_lock<shared_mutex> gate(treeLatch);
+        unique_lock<shared_mutex> rootGuard(rootLatch);
+
         if (rootOffset == 0) {
             BTreeNode<K, V> root;
             root.isLeaf = true;
@@ -637,52 +1706,126 @@ public:
             root.keys[0] = key;
             root.values[0] = value;
 
+            Step step;
             rootOffset = allocateNode();
-            writeNode(root, rootOffset);
-            saveMetadata();
+            writeNode(root, rootOffset, step);
+            keyCount = 1;
+            logStep(step, true);
+            saveOperation();
+            pinUpperLevels(root);
             return;
         }
 
+        unique_lock<shared_mutex> guard(latchFor(rootOffset));
         BTreeNode<K, V> root = readNode(rootOffset);
 
-        if (root.numKeys == 2 * BTREE_DEGREE - 1) {
+        if (root.numKeys == 2 * DEGREE - 1) {
             BTreeNode<K, V> newRoot;
             newRoot.isLeaf = false;
             newRoot.numKeys = 0;
 
             uint64_t oldRootOffset = rootOffset;
-            rootOffset = allocateNode();
+            uint64_t newRootOffset = allocateNode();
+
+            // Nothing can reach the old root while rootLatch is held, so it
+            // is released and re-taken to keep the parent-first latch order.
+            guard.unlock();
+            unique_lock<shared_mutex> newRootGuard(latchFor(newRootOffset));
+            guard.lock();
 
             newRoot.children[0] = oldRootOffset;
-            writeNode(newRoot, rootOffset);
+            newRoot.nodeOffset = newRootOffset;
+            rootOffset = newRootOffset;
+
+            Step step;
+            splitChild(newRoot, 0, step);
+            writeNode(newRoot, newRootOffset, step);
+            logStep(step, true);
+            pinUpperLevels(newRoot);
+
+            guard.swap(newRootGuard);
+            newRootGuard.unlock();
+            root = newRoot;
+        }
 
-            splitChild(newRoot, 0);
-            writeNode(newRoot, rootOffset);
-            saveMetadata();
+        rootGuard.unlock();
 
-            insertNonFull(rootOffset, key, value);
-        }
-        else {
-            insertNonFull(rootOffset, key, value);
+        if (insertNonFull(root, guard, key, value)) {
+            keyCount++;
         }
+        saveOperation();
+    }
+
+    // For key-only trees (V = BTreeNoValue).
+    void insert(K key) {
+        insert(key, V());
+    }
+
+    bool contains(K key) {
+        V value;
+        return search(key, value);
     }
 
     bool search(K key, V& value) {
-        return searchInternal(rootOffset, key, value);
+        if (memoryMapped) {
+            return searchMapped(key, value);
+        }
+
+        BTreeNode<K, V> leaf;
+        if (!findLeaf(key, leaf, false)) {
+            return false;
+        }
+
+        uint32_t idx = findKeyIndex(leaf, key);
+        if (idx < leaf.numKeys && leaf.keys[idx] == key) {
+            value = leaf.values[idx];
+            return true;
+        }
+        return false;
+    }
+
+    Iterator begin() {
+        return Iterator(this, false, K(), false, K());
+    }
+
+    Iterator end() {
+        return Iterator();
+    }
+
+    Iterator lowerBound(K key) {
+        return Iterator(this, true, key, false, K());
+    }
+
+    // Streams the pairs with lo <= key <= hi in key order, one leaf at a time.
+    Range rangeScan(K lo, K hi) {
+        Range range;
+        if (!(hi < lo)) {
+            range.first = Iterator(this, true, lo, true, hi);
+        }
+        return range;
     }
 
     vector<pair<K, V>> getAllPairs() {
         vector<pair<K, V>> result;
-        if (rootOffset != 0) {
-            traverseInternal(rootOffset, result);
+        for (Iterator it = begin(); it != end(); ++it) {
+            result.push_back(*it);
         }
         return result;
     }
 
+    void flush() {
+        shared_lock<shared_mutex> gate(treeLatch);
+        flushNodes();
+        saveMetadata();
+        fdatasync(fd);
+    }
+
     void close() {
-        if (file.is_open()) {
-            saveMetadata();
-            file.close();
+        if (fd >= 0) {
+            flush();
+            unmapFile();
+            ::close(fd);
+            fd = -1;
         }
     }
 
@@ -694,46 +1837,192 @@ public:
         return rootOffset;
     }
 
-    size_t size() {
-        return getAllPairs().size();
+    size_t size() const {
+        return keyCount;
+    }
+
+    uint64_t getCacheHits() const {
+        return cache->getHits();
+    }
+
+    uint64_t getCacheMisses() const {
+        return cache->getMisses();
     }
 
     void create() {
-        file.open(indexFile, ios::out | ios::binary);
-        file.close();
-        file.open(indexFile, ios::in | ios::out | ios::binary);
+        cache->clear();
+        if (ftruncate(fd, 0) != 0) {
+            throw runtime_error("Failed to truncate index file");
+        }
 
         rootOffset = 0;
-        nextFreeOffset = sizeof(uint64_t) * 2;
+        nextFreeOffset = slotSize();
+        keyCount = 0;
+        resetFreeMap();
+        if (mapBase != nullptr) {
+            remapFile();
+        }
+
+        saveMetadata();
+        markRewritten();
+    }
+
+    // Rewrites the live pairs into a fresh file with the bulk loader and
+    // swaps it in, so the index shrinks to its live nodes. Other operations
+    // wait while it runs; open iterators re-seek afterwards.
+    void compact(float fillFactor = BTREE_BULK_FILL_FACTOR) {
+        unique_lock<shared_mutex> gate(treeLatch);
+
+        flushNodes();
+        saveMetadata();
+        markRewritten();
+
+        string compactFile = indexFile + ".compact";
+        unlink(compactFile.c_str());
+
+        {
+            BTree<K, V> dense(compactFile);
+            BulkLoader loader = dense.bulkLoader(fillFactor);
+
+            if (rootOffset != 0) {
+                BTreeNode<K, V> node = readNode(rootOffset);
+                while (!node.isLeaf) {
+                    node = readNode(node.children[0]);
+                }
+
+                while (true) {
+                    for (uint32_t i = 0; i < node.numKeys; i++) {
+                        loader.add(node.keys[i], node.values[i]);
+                    }
+                    if (node.nextLeaf == 0) {
+                        break;
+                    }
+                    node = readNode(node.nextLeaf);
+                }
+            }
+
+            loader.finish();
+        }
+
+        if (rename(compactFile.c_str(), indexFile.c_str()) != 0) {
+            throw runtime_error("Failed to replace index file with compacted copy");
+        }
+
+        cache->clear();
+        latches->forEach([](uint64_t, shared_mutex* latch) {
+            delete latch;
+        });
+        latches->clear();
+
+        unmapFile();
+        ::close(fd);
+        fd = open(indexFile.c_str(), O_RDWR);
+        if (fd < 0) {
+            throw runtime_error("Failed to open index file");
+        }
+
+        loadMetadata();
+        if (memoryMapped) {
+            mapFile();
+        }
+        if (rootOffset != 0) {
+            pinUpperLevels(readNode(rootOffset));
+        }
+        structureVersion++;
+    }
 
-        file.seekp(0);
-        file.write(reinterpret_cast<const char*>(&rootOffset), sizeof(uint64_t));
-        file.write(reinterpret_cast<const char*>(&nextFreeOffset), sizeof(uint64_t));
-        file.flush();
+    uint64_t getFileSize() {
+        lock_guard<mutex> lock(allocMutex);
+        return nextFreeOffset + (blockFor(nextFreeOffset) + 7) / 8;
     }
 
+    size_t getFreeSlots() {
+        lock_guard<mutex> lock(allocMutex);
+        return freeSlots;
+    }
+
+    // Refills each child below minimum occupancy before descending into it,
+    // so the leaf can always give up a key without touching its ancestors.
     bool remove(K key) {
+        shared_lock<shared_mutex> gate(treeLatch);
+        unique_lock<shared_mutex> rootGuard(rootLatch);
         if (rootOffset == 0) {
             return false;
         }
 
-        bool removed = removeInternal(rootOffset, key);
+        unique_lock<shared_mutex> guard(latchFor(rootOffset));
+        BTreeNode<K, V> node = readNode(rootOffset);
 
-        if (removed) {
-            BTreeNode<K, V> root = readNode(rootOffset);
+        while (!node.isLeaf) {
+            uint32_t idx = findChildIndex(node, key);
 
-            if (root.numKeys == 0) {
-                if (root.isLeaf) {
-                    rootOffset = 0;
-                }
-                else {
-                    rootOffset = root.children[0];
+            unique_lock<shared_mutex> childGuard(latchFor(node.children[idx]));
+            BTreeNode<K, V> child = readNode(node.children[idx]);
+
+            if (child.numKeys < DEGREE) {
+                childGuard.unlock();
+
+                Step step;
+                fill(node, idx, step);
+
+                if (rootGuard.owns_lock() && node.numKeys == 0) {
+                    uint64_t oldRootOffset = node.nodeOffset;
+                    rootOffset = node.children[0];
+                    logStep(step, true);
+
+                    unique_lock<shared_mutex> newRootGuard(latchFor(rootOffset));
+                    guard.swap(newRootGuard);
+                    newRootGuard.unlock();
+
+                    cache->erase(oldRootOffset);
+                    freeNode(oldRootOffset);
+
+                    node = readNode(rootOffset);
+                    pinUpperLevels(node);
+                    continue;
                 }
-                saveMetadata();
+
+                logStep(step, false);
+
+                idx = findChildIndex(node, key);
+                unique_lock<shared_mutex> refilledGuard(latchFor(node.children[idx]));
+                childGuard.swap(refilledGuard);
+                child = readNode(node.children[idx]);
             }
+
+            guard.swap(childGuard);
+            childGuard.unlock();
+            if (rootGuard.owns_lock()) {
+                rootGuard.unlock();
+            }
+            node = child;
+        }
+
+        uint32_t idx = findKeyIndex(node, key);
+        if (idx >= node.numKeys || !(node.keys[idx] == key)) {
+            saveOperation();
+            return false;
+        }
+
+        Step step;
+        removeFromLeaf(node, idx);
+        writeNode(node, node.nodeOffset, step);
+        keyCount--;
+
+        if (rootGuard.owns_lock() && node.numKeys == 0) {
+            rootOffset = 0;
+            logStep(step, true);
+
+            cache->erase(node.nodeOffset);
+            cache->unpinAll();
+            freeNode(node.nodeOffset);
+        }
+        else {
+            logStep(step, false);
         }
 
-        return removed;
+        saveOperation();
+        return true;
     }
 
 };
@@ -0,0 +1,171 @@
+#ifndef CONCURRENT_HASH_MAP_H
+#define CONCURRENT_HASH_MAP_H
+
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <shared_mutex>
+#include "hash_table.h"
+#include "types.h"
+using namespace std;
+
+// Thread-safe map built from CONCURRENT_MAP_SHARDS independent HashTables,
+// each behind its own shared_mutex. The low bits of the key's hash pick the
+// shard (the table itself indexes with the high bits), so unrelated keys
+// rarely contend. Lookups take the shard lock shared and run in parallel
+// with each other; writers only block readers of the same shard.
+//
+// Values are returned by copy. update and modify run a callback on the
+// stored value while the shard is held exclusively, for read-modify-write
+// without a separate lock.
+template<typename K, typename V, typename H = HashPolicy<K>>
+class ConcurrentHashMap {
+private:
+    struct alignas(64) Shard {
+        mutable shared_mutex latch;
+        HashTable<K, V, H> table;
+
+        Shard(size_t cap) : table(cap) {}
+    };
+
+    vector<Shard*> shards;
+    H hasher;
+
+    template<typename Q>
+    Shard& shardFor(const Q& key) const {
+        return *shards[hasher(key) & (CONCURRENT_MAP_SHARDS - 1)];
+    }
+
+public:
+    ConcurrentHashMap(size_t cap = HASH_TABLE_SIZE) {
+        size_t perShard = cap / CONCURRENT_MAP_SHARDS + 1;
+        for (size_t i = 0; i < CONCURRENT_MAP_SHARDS; i++) {
+            shards.push_back(new Shard(perShard));
+        }
+    }
+
+    ~ConcurrentHashMap() {
+        for (Shard* shard : shards) {
+            delete shard;
+        }
+    }
+
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+    void insert(const K& key, const V& value) {
+        Shard& shard = shardFor(key);
+        unique_lock<shared_mutex> lock(shard.latch);
+        shard.table.insert(key, value);
+    }
+
+    // Inserts only if the key is absent. Returns false and leaves the
+    // existing value in place otherwise.
+    bool insertIfAbsent(const K& key, const V& value) {
+        Shard& shard = shardFor(key);
+        unique_lock<shared_mutex> lock(shard.latch);
+        if (shard.table.contains(key)) {
+            return false;
+        }
+        shard.table.insert(key, value);
+        return true;
+    }
+
+    template<typename Q>
+    bool find(const Q& key, V& value) const {
+        Shard& shard = shardFor(key);
+        shared_lock<shared_mutex> lock(shard.latch);
+        return shard.table.find(key, value);
+    }
+
+    template<typename Q>
+    bool contains(const Q& key) const {
+        Shard& shard = shardFor(key);
+        shared_lock<shared_mutex> lock(shard.latch);
+        return shard.table.contains(key);
+    }
+
+    // Calls fn(V&) on the stored value, inserting a default-constructed one
+    // first if the key is absent.
+    template<typename F>
+    void update(const K& key, F fn) {
+        Shard& shard = shardFor(key);
+        unique_lock<shared_mutex> lock(shard.latch);
+        V* value = shard.table.get(key);
+        if (value == nullptr) {
+            shard.table.insert(key, V());
+            value = shard.table.get(key);
+        }
+        fn(*value);
+    }
+
+    // Calls fn(V&) on the stored value if the key is present.
+    template<typename Q, typename F>
+    bool modify(const Q& key, F fn) {
+        Shard& shard = shardFor(key);
+        unique_lock<shared_mutex> lock(shard.latch);
+        V* value = shard.table.get(key);
+        if (value == nullptr) {
+            return false;
+        }
+        fn(*value);
+        return true;
+    }
+
+    template<typename Q>
+    void remove(const Q& key) {
+        Shard& shard = shardFor(key);
+        unique_lock<shared_mutex> lock(shard.latch);
+        shard.table.remove(key);
+    }
+
+    // Calls fn(key, value) for every entry, holding each shard shared while
+    // it is scanned. fn must not call back into the map.
+    template<typename F>
+    void forEach(F fn) const {
+        for (Shard* shard : shards) {
+            shared_lock<shared_mutex> lock(shard->latch);
+            shard->table.forEach(fn);
+        }
+    }
+
+    // Snapshots are taken shard by shard, so a concurrent writer may be
+    // reflected in some shards and not others.
+    vector<K> getAllKeys() const {
+        vector<K> keys;
+        for (Shard* shard : shards) {
+            shared_lock<shared_mutex> lock(shard->latch);
+            vector<K> part = shard->table.getAllKeys();
+            keys.insert(keys.end(), part.begin(), part.end());
+        }
+        return keys;
+    }
+
+    vector<pair<K, V>> getAllPairs() const {
+        vector<pair<K, V>> pairs;
+        for (Shard* shard : shards) {
+            shared_lock<shared_mutex> lock(shard->latch);
+            vector<pair<K, V>> part = shard->table.getAllPairs();
+            pairs.insert(pairs.end(), part.begin(), part.end());
+        }
+        return pairs;
+    }
+
+    size_t getSize() const {
+        size_t total = 0;
+        for (Shard* shard : shards) {
+            shared_lock<shared_mutex> lock(shard->latch);
+            total = total + shard->table.getSize();
+        }
+        return total;
+    }
+
+    void clear() {
+        for (Shard* shard : shards) {
+            unique_lock<shared_mutex> lock(shard->latch);
+            shard->table.clear();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef EDGE_CODEC_H
+#define EDGE_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <stdexcept>
+#include "../graph/node.h"
+using namespace std;
+
+// Compressed encoding for one owner's edges, sorted by neighbour ID:
+//
+//   count     varint
+//   ratings   one 4-bit code per edge, two per byte, low nibble first;
+//             code c means ratingValue c * 50 (half stars), 0 means the
+//             value is in the exceptions stream
+//   ids       first ID, then the gap to each next ID, as varints
+//   times     first timestamp, then zigzag deltas, as varints
+//   exceptions  ratingValue of each code-0 edge, as varints
+//
+// Each field is its own stream, so decoding is a few flat loops with no
+// per-edge branching on layout. Varints are little-endian base-128 with
+// a one-byte fast path, which is where almost every gap and time delta
+// lands.
+class EdgeCodec {
+private:
+    static const uint32_t RATING_STEP = 50;
+    static const uint32_t MAX_CODE = 15;
+
+    static void putVarint(vector<char>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value = value >> 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static uint64_t getVarint(const uint8_t*& p) {
+        uint64_t value = *p++;
+        if (value < 0x80) {
+            return value;
+        }
+
+        value = value & 0x7f;
+        for (int shift = 7; shift < 64; shift = shift + 7) {
+            uint64_t byte = *p++;
+            value = value | ((byte & 0x7f) << shift);
+            if (byte < 0x80) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    static uint64_t zigzag(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value) {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    static uint8_t ratingCode(uint32_t ratingValue) {
+        if (ratingValue % RATING_STEP != 0 || ratingValue / RATING_STEP > MAX_CODE) {
+            return 0;
+        }
+        return static_cast<uint8_t>(ratingValue / RATING_STEP);
+    }
+
+public:
+    // Appends the encoding of edges, which must be sorted by movieID with
+    // no duplicates. An empty list encodes to nothing.
+    static void encode(const vector<RatingEdge>& edges, vector<char>& out) {
+        size_t n = edges.size();
+        if (n == 0) {
+            return;
+        }
+
+        putVarint(out, n);
+
+        size_t nibbles = out.size();
+        out.resize(nibbles + (n + 1) / 2, 0);
+        for (size_t i = 0; i < n; i++) {
+            uint8_t code = ratingCode(edges[i].ratingValue);
+            out[nibbles + i / 2] = static_cast<char>(out[nibbles + i / 2] | (code << ((i % 2) * 4)));
+        }
+
+        uint32_t previousID = 0;
+        for (size_t i = 0; i < n; i++) {
+            putVarint(out, edges[i].movieID - previousID);
+            previousID = edges[i].movieID;
+        }
+
+        putVarint(out, edges[0].timestamp);
+        for (size_t i = 1; i < n; i++) {
+            putVarint(out, zigzag(static_cast<int64_t>(edges[i].timestamp - edges[i - 1].timestamp)));
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (ratingCode(edges[i].ratingValue) == 0) {
+                putVarint(out, edges[i].ratingValue);
+            }
+        }
+    }
+
+    // Replaces out with the edges encoded at data, which spans length bytes.
+    static void decode(const char* data, size_t length, vector<RatingEdge>& out) {
+        out.clear();
+        if (length == 0) {
+            return;
+        }
+
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        const uint8_t* end = p + length;
+        size_t n = static_cast<size_t>(getVarint(p));
+        out.resize(n);
+
+        const uint8_t* nibbles = p;
+        p = p + (n + 1) / 2;
+        for (size_t i = 0; i < n; i++) {
+            out[i].ratingValue = ((nibbles[i / 2] >> ((i % 2) * 4)) & 0x0f) * RATING_STEP;
+        }
+
+        uint32_t id = 0;
+        for (size_t i = 0; i < n; i++) {
+            id = id + static_cast<uint32_t>(getVarint(p));
+            out[i].movieID = id;
+        }
+
+        uint64_t timestamp = getVarint(p);
+        out[0].timestamp = timestamp;
+        for (size_t i = 1; i < n; i++) {
+            timestamp = timestamp + static_cast<uint64_t>(unzigzag(getVarint(p)));
+            out[i].timestamp = timestamp;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (out[i].ratingValue == 0) {
+                out[i].ratingValue = static_cast<uint32_t>(getVarint(p));
+            }
+        }
+
+        if (p != end) {
+            throw runtime_error("Corrupt edge block");
+        }
+    }
+
+    // Looks up one neighbour's ratingValue. IDs are read only up to the
+    // first one not below the target, and the rest of the block only if
+    // the rating is an exception.
+    static bool findRating(const char* data, size_t length, uint32_t neighbour, uint32_t& ratingValue) {
+        if (length == 0) {
+            return false;
+        }
+
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        size_t n = static_cast<size_t>(getVarint(p));
+        const uint8_t* nibbles = p;
+        p = p + (n + 1) / 2;
+
+        uint32_t id = 0;
+        size_t i = 0;
+        while (i < n) {
+            id = id + static_cast<uint32_t>(getVarint(p));
+            if (id >= neighbour) {
+                break;
+            }
+            i++;
+        }
+        if (i == n || id != neighbour) {
+            return false;
+        }
+
+        uint32_t code = (nibbles[i / 2] >> ((i % 2) * 4)) & 0x0f;
+        if (code != 0) {
+            ratingValue = code * RATING_STEP;
+            return true;
+        }
+
+        vector<RatingEdge> edges;
+        decode(data, length, edges);
+        ratingValue = edges[i].ratingValue;
+        return true;
+    }
+
+    // Edge count of the block at data without decoding it.
+    static size_t count(const char* data, size_t length) {
+        if (length == 0) {
+            return 0;
+        }
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        return static_cast<size_t>(getVarint(p));
+    }
+};
+
+#endif
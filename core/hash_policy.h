@@ -0,0 +1,95 @@
+#ifndef HASH_POLICY_H
+#define HASH_POLICY_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Hash functors for HashTable. They return a full 64-bit hash; the table
+// takes its slot index from the top bits, so every bit has to be mixed.
+// A custom policy is any type with a const operator() returning uint64_t.
+
+// Integer keys: the murmur3 64-bit finalizer.
+template<typename K>
+struct HashPolicy {
+    uint64_t operator()(K key) const {
+        uint64_t x = static_cast<uint64_t>(key);
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        x ^= x >> 33;
+        return x;
+    }
+};
+
+// String keys: a wyhash-style hash that consumes 8 or 16 bytes per step
+// through 64x64->128-bit multiplies. Takes string_view so that lookups by
+// view or literal need no temporary string.
+template<>
+struct HashPolicy<string> {
+    static const uint64_t SECRET0 = 0xa0761d6478bd642full;
+    static const uint64_t SECRET1 = 0xe7037ed1a0b428dbull;
+    static const uint64_t SECRET2 = 0x8ebc6af09c88c6e3ull;
+    static const uint64_t SECRET3 = 0x589965cc75374cc3ull;
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        __uint128_t product = static_cast<__uint128_t>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    static uint64_t read8(const char* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(uint64_t));
+        return v;
+    }
+
+    static uint64_t read4(const char* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(uint32_t));
+        return v;
+    }
+
+    uint64_t operator()(string_view key) const {
+        const char* p = key.data();
+        size_t len = key.size();
+        uint64_t seed = SECRET0 ^ mix(SECRET0 ^ len, SECRET1);
+        uint64_t a;
+        uint64_t b;
+
+        if (len <= 16) {
+            if (len >= 4) {
+                size_t step = (len >> 3) << 2;
+                a = (read4(p) << 32) | read4(p + step);
+                b = (read4(p + len - 4) << 32) | read4(p + len - 4 - step);
+            }
+            else if (len > 0) {
+                a = (static_cast<uint64_t>(static_cast<unsigned char>(p[0])) << 16) |
+                    (static_cast<uint64_t>(static_cast<unsigned char>(p[len >> 1])) << 8) |
+                    static_cast<unsigned char>(p[len - 1]);
+                b = 0;
+            }
+            else {
+                a = 0;
+                b = 0;
+            }
+        }
+        else {
+            size_t remaining = len;
+            while (remaining > 16) {
+                seed = mix(read8(p) ^ SECRET1, read8(p + 8) ^ seed);
+                p = p + 16;
+                remaining = remaining - 16;
+            }
+            a = read8(p + remaining - 16);
+            b = read8(p + remaining - 8);
+        }
+
+        return mix(SECRET1 ^ len, mix(a ^ SECRET1, b ^ seed) ^ SECRET2) ^ SECRET3;
+    }
+};
+
+#endif
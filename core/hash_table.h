@@ -3,66 +3,233 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include "hash_policy.h"
 #include "types.h"
 using namespace std;
 
-template<typename K, typename V>
-struct HashNode {
-    K key;
-    V value;
-    HashNode* next;
+// Open-addressing hash table with Robin Hood probing. Entries live in one
+// flat array; a parallel byte array holds each slot's probe distance plus
+// one (0 = empty). An insert that has probed further than the resident
+// entry takes its slot and carries the resident on, which keeps probe
+// sequences short. Removal shifts the following run back by one instead of
+// leaving tombstones. The table doubles once it is HASH_TABLE_LOAD_FACTOR
+// full; the constructor argument is only an initial size hint.
+//
+// find, contains and remove accept any key type the policy can hash and
+// that compares equal to K, e.g. a string_view for string keys.
+//
+// Iterators, forEach and topK scan the slot array in place. Order is
+// unspecified, and any insert or remove invalidates them.
+template<typename K, typename V, typename H = HashPolicy<K>>
+class HashTable {
+public:
+    struct Entry {
+        K key;
+        V value;
 
-    HashNode(K k, V v) : key(k), value(v), next(nullptr) {}
-};
+        Entry() : key(), value() {}
+        Entry(const K& k, const V& v) : key(k), value(v) {}
+    };
 
-template<typename K, typename V>
-class HashTable {
 private:
-    HashNode<K, V>** table;
+    static const uint8_t MAX_PROBE = 255;
+
+    vector<Entry> entries;
+    vector<uint8_t> probes;
     size_t capacity;
+    size_t mask;
+    size_t shift;
     size_t size;
+    size_t growAt;
+    H hasher;
+
+    template<typename Q>
+    size_t home(const Q& key) const {
+        return static_cast<size_t>(hasher(key) >> shift);
+    }
+
+    void allocate(size_t slots) {
+        capacity = 8;
+        shift = 61;
+        while (capacity < slots) {
+            capacity = capacity * 2;
+            shift--;
+        }
+        mask = capacity - 1;
+        growAt = static_cast<size_t>(capacity * HASH_TABLE_LOAD_FACTOR);
+
+        entries.assign(capacity, Entry());
+        probes.assign(capacity, 0);
+    }
+
+    void grow() {
+        vector<Entry> oldEntries;
+        vector<uint8_t> oldProbes;
+        oldEntries.swap(entries);
+        oldProbes.swap(probes);
+
+        allocate(capacity * 2);
+        for (size_t i = 0; i < oldEntries.size(); i++) {
+            if (oldProbes[i] != 0) {
+                place(oldEntries[i]);
+            }
+        }
+    }
+
+    // Places an entry whose key is known to be absent. Grows and starts
+    // over if a probe run would overflow its distance byte.
+    void place(Entry entry) {
+        while (true) {
+            size_t index = home(entry.key);
+            uint8_t probe = 1;
+
+            while (probe < MAX_PROBE) {
+                if (probes[index] == 0) {
+                    entries[index] = move(entry);
+                    probes[index] = probe;
+                    return;
+                }
+
+                if (probes[index] < probe) {
+                    swap(entries[index], entry);
+                    swap(probes[index], probe);
+                }
 
-    size_t hash(uint32_t key) const {
-        return key % capacity;
+                index = (index + 1) & mask;
+                probe++;
+            }
+
+            grow();
+        }
     }
 
-    size_t hash(const string& key) const {
-        size_t hashVal = 0;
-        for (size_t i = 0; i < key.length(); i++) {
-            hashVal = (hashVal * 31 + static_cast<size_t>(key[i])) % capacity;
+    template<typename Q>
+    bool locate(const Q& key, size_t& index) const {
+        index = home(key);
+        for (uint8_t probe = 1; probe <= probes[index]; probe++) {
+            if (entries[index].key == key) {
+                return true;
+            }
+            index = (index + 1) & mask;
         }
-        return hashVal;
+        return false;
     }
 
 public:
-    HashTable(size_t cap = HASH_TABLE_SIZE)
-        : capacity(cap), size(0) {
-        table = new HashNode<K, V>* [capacity];
-        for (size_t i = 0; i < capacity; i++) {
-            table[i] = nullptr;
+    class Iterator {
+    private:
+        const HashTable* table;
+        size_t index;
+
+        void settle() {
+            while (index < table->capacity && table->probes[index] == 0) {
+                index++;
+            }
+        }
+
+    public:
+        Iterator(const HashTable* t, size_t start) : table(t), index(start) {
+            settle();
+        }
+
+        const K& key() const {
+            return table->entries[index].key;
+        }
+
+        const V& value() const {
+            return table->entries[index].value;
+        }
+
+        Iterator& operator++() {
+            index++;
+            settle();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return index == other.index;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return index != other.index;
         }
+    };
+
+    HashTable(size_t cap = HASH_TABLE_SIZE) : size(0) {
+        allocate(static_cast<size_t>(cap / HASH_TABLE_LOAD_FACTOR) + 1);
     }
 
-    ~HashTable() {
-        clear();
-        delete[] table;
+    Iterator begin() const {
+        return Iterator(this, 0);
     }
 
-    void insert(const K& key, const V& value) {
-        size_t index = hash(key);
+    Iterator end() const {
+        return Iterator(this, capacity);
+    }
 
-        HashNode<K, V>* current = table[index];
-        while (current != nullptr) {
-            if (current->key == key) {
-                current->value = value;
-                return;
+    // Calls fn(key, value) for every entry.
+    template<typename F>
+    void forEach(F fn) const {
+        for (size_t i = 0; i < capacity; i++) {
+            if (probes[i] != 0) {
+                fn(entries[i].key, entries[i].value);
             }
-            current = current->next;
         }
+    }
+
+    // The n entries that rank first under better(a, b), best first. The
+    // comparator sees entries in place (a.key, a.value); only the winners
+    // are copied out.
+    template<typename C>
+    vector<pair<K, V>> topK(size_t n, C better) const {
+        vector<size_t> heap;
+        heap.reserve(n < size ? n : size);
 
-        HashNode<K, V>* newNode = new HashNode<K, V>(key, value);
-        newNode->next = table[index];
-        table[index] = newNode;
+        // Ordered by better, the heap front is the worst slot kept.
+        auto order = [this, &better](size_t a, size_t b) {
+            return better(entries[a], entries[b]);
+        };
+
+        for (size_t i = 0; i < capacity && n > 0; i++) {
+            if (probes[i] == 0) {
+                continue;
+            }
+
+            if (heap.size() < n) {
+                heap.push_back(i);
+                push_heap(heap.begin(), heap.end(), order);
+            }
+            else if (better(entries[i], entries[heap.front()])) {
+                pop_heap(heap.begin(), heap.end(), order);
+                heap.back() = i;
+                push_heap(heap.begin(), heap.end(), order);
+            }
+        }
+
+        sort_heap(heap.begin(), heap.end(), order);
+
+        vector<pair<K, V>> result;
+        result.reserve(heap.size());
+        for (size_t index : heap) {
+            result.push_back(make_pair(entries[index].key, entries[index].value));
+        }
+        return result;
+    }
+
+    void insert(const K& key, const V& value) {
+        size_t index;
+        if (locate(key, index)) {
+            entries[index].value = value;
+            return;
+        }
+
+        if (size + 1 > growAt) {
+            grow();
+        }
+        place(Entry(key, value));
         size++;
     }
 
@@ -71,10 +238,8 @@ public:
         keys.reserve(size);
 
         for (size_t i = 0; i < capacity; i++) {
-            HashNode<K, V>* current = table[i];
-            while (current != nullptr) {
-                keys.push_back(current->key);
-                current = current->next;
+            if (probes[i] != 0) {
+                keys.push_back(entries[i].key);
             }
         }
         return keys;
@@ -85,77 +250,85 @@ public:
         pairs.reserve(size);
 
         for (size_t i = 0; i < capacity; i++) {
-            HashNode<K, V>* current = table[i];
-            while (current != nullptr) {
-                pairs.push_back(make_pair(current->key, current->value));
-                current = current->next;
+            if (probes[i] != 0) {
+                pairs.push_back(make_pair(entries[i].key, entries[i].value));
             }
         }
         return pairs;
     }
 
-    bool find(const K& key, V& value) const {
-        size_t index = hash(key);
-        HashNode<K, V>* current = table[index];
-
-        while (current != nullptr) {
-            if (current->key == key) {
-                value = current->value;
-                return true;
-            }
-            current = current->next;
+    template<typename Q>
+    bool find(const Q& key, V& value) const {
+        size_t index;
+        if (!locate(key, index)) {
+            return false;
         }
-        return false;
+        value = entries[index].value;
+        return true;
     }
 
-    bool contains(const K& key) const {
-        size_t index = hash(key);
-        HashNode<K, V>* current = table[index];
-
-        while (current != nullptr) {
-            if (current->key == key) {
-                return true;
-            }
-            current = current->next;
+    // Stored value for in-place updates; valid until the next insert or
+    // remove. Null if the key is absent.
+    template<typename Q>
+    V* get(const Q& key) {
+        size_t index;
+        if (!locate(key, index)) {
+            return nullptr;
         }
-        return false;
+        return &entries[index].value;
     }
 
-    void remove(const K& key) {
-        size_t index = hash(key);
-        HashNode<K, V>* current = table[index];
-        HashNode<K, V>* prev = nullptr;
+    template<typename Q>
+    bool contains(const Q& key) const {
+        size_t index;
+        return locate(key, index);
+    }
 
-        while (current != nullptr) {
-            if (current->key == key) {
-                if (prev == nullptr) {
-                    table[index] = current->next;
-                }
-                else {
-                    prev->next = current->next;
-                }
-                delete current;
-                size--;
-                return;
-            }
-            prev = current;
-            current = current->next;
+    template<typename Q>
+    void remove(const Q& key) {
+        size_t index;
+        if (!locate(key, index)) {
+            return;
+        }
+
+        size_t next = (index + 1) & mask;
+        while (probes[next] > 1) {
+            entries[index] = move(entries[next]);
+            probes[index] = probes[next] - 1;
+            index = next;
+            next = (next + 1) & mask;
         }
+
+        entries[index] = Entry();
+        probes[index] = 0;
+        size--;
     }
 
     size_t getSize() const {
         return size;
     }
 
+    // Number of entries at each probe distance; index d counts entries
+    // found d slots along their probe sequence, 1 being the home slot.
+    vector<size_t> getProbeCounts() const {
+        vector<size_t> counts(MAX_PROBE + 1, 0);
+        for (size_t i = 0; i < capacity; i++) {
+            counts[probes[i]]++;
+        }
+        counts[0] = 0;
+
+        while (counts.size() > 1 && counts.back() == 0) {
+            counts.pop_back();
+        }
+        return counts;
+    }
+
     void clear() {
         for (size_t i = 0; i < capacity; i++) {
-            HashNode<K, V>* current = table[i];
-            while (current != nullptr) {
-                HashNode<K, V>* temp = current;
-                current = current->next;
-                delete temp;
+            if (probes[i] != 0) {
+                entries[i] = Entry();
+                probes[i] = 0;
             }
-            table[i] = nullptr;
         }
         size = 0;
     }
@@ -0,0 +1,111 @@
+#ifndef NODE_SEARCH_H
+#define NODE_SEARCH_H
+
+#include <cstdint>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// In-node key search for BTree. lowerBound returns the first slot whose key
+// is not less than key, upperBound the first slot whose key is greater.
+// The generic version is a branchless binary search that only needs
+// operator<; uint32_t keys finish the search with an AVX2
+// compare/movemask count when the compiler targets AVX2.
+template<typename K>
+struct NodeSearch {
+    static uint32_t lowerBound(const K* keys, uint32_t count, const K& key) {
+        if (count == 0) {
+            return 0;
+        }
+
+        const K* base = keys;
+        uint32_t n = count;
+        while (n > 1) {
+            uint32_t half = n / 2;
+            base = (base[half] < key) ? base + half : base;
+            n = n - half;
+        }
+        return static_cast<uint32_t>(base - keys) + (*base < key ? 1 : 0);
+    }
+
+    static uint32_t upperBound(const K* keys, uint32_t count, const K& key) {
+        if (count == 0) {
+            return 0;
+        }
+
+        const K* base = keys;
+        uint32_t n = count;
+        while (n > 1) {
+            uint32_t half = n / 2;
+            base = (key < base[half]) ? base : base + half;
+            n = n - half;
+        }
+        return static_cast<uint32_t>(base - keys) + (key < *base ? 0 : 1);
+    }
+};
+
+#ifdef __AVX2__
+// Narrows to a window of at most SIMD_WINDOW keys with the branchless
+// binary search, then counts the keys below (or not above) the probe in
+// that window eight lanes at a time. Counting a whole node instead costs
+// more than the binary search once nodes hold a few dozen keys. AVX2 only
+// compares signed integers, so both sides have the sign bit flipped first.
+template<>
+struct NodeSearch<uint32_t> {
+    static const uint32_t SIMD_WINDOW = 16;
+
+    static uint32_t lowerBound(const uint32_t* keys, uint32_t count, const uint32_t& key) {
+        const uint32_t* base = keys;
+        uint32_t n = count;
+        while (n > SIMD_WINDOW) {
+            uint32_t half = n / 2;
+            base = (base[half] < key) ? base + half : base;
+            n = n - half;
+        }
+
+        const __m256i flip = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+        const __m256i probe = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(key)), flip);
+
+        uint32_t below = static_cast<uint32_t>(base - keys);
+        uint32_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i));
+            __m256i less = _mm256_cmpgt_epi32(probe, _mm256_xor_si256(block, flip));
+            below = below + __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+        }
+        for (; i < n; i++) {
+            below = below + (base[i] < key ? 1 : 0);
+        }
+        return below;
+    }
+
+    static uint32_t upperBound(const uint32_t* keys, uint32_t count, const uint32_t& key) {
+        const uint32_t* base = keys;
+        uint32_t n = count;
+        while (n > SIMD_WINDOW) {
+            uint32_t half = n / 2;
+            base = (key < base[half]) ? base : base + half;
+            n = n - half;
+        }
+
+        const __m256i flip = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+        const __m256i probe = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(key)), flip);
+
+        uint32_t notAbove = static_cast<uint32_t>(base - keys);
+        uint32_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i));
+            __m256i greater = _mm256_cmpgt_epi32(_mm256_xor_si256(block, flip), probe);
+            notAbove = notAbove + 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(greater)));
+        }
+        for (; i < n; i++) {
+            notAbove = notAbove + (key < base[i] ? 0 : 1);
+        }
+        return notAbove;
+    }
+};
+#endif
+
+#endif
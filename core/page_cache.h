@@ -0,0 +1,236 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include "hash_table.h"
+#include "types.h"
+
+using namespace std;
+
+// Bounded page cache with CLOCK eviction. Pinned frames are never evicted,
+// dirty frames are handed to the write-back callback on eviction or flush().
+template<typename PageType>
+class PageCache {
+private:
+    struct Frame {
+        uint64_t key;
+        PageType page;
+        bool valid;
+        bool dirty;
+        bool referenced;
+        bool pinned;
+
+        Frame() : key(0), valid(false), dirty(false), referenced(false), pinned(false) {}
+    };
+
+    vector<Frame> frames;
+    vector<uint32_t> freeFrames;
+    HashTable<uint64_t, uint32_t>* frameIndex;
+    HashTable<uint64_t, bool>* pinnedKeys;
+    size_t capacity;
+    size_t used;
+    size_t clockHand;
+
+    function<void(uint64_t, const PageType&)> writeBack;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    mutable mutex cacheMutex;
+
+    bool findVictim(uint32_t& victim) {
+        if (!freeFrames.empty()) {
+            victim = freeFrames.back();
+            freeFrames.pop_back();
+            return true;
+        }
+
+        for (size_t step = 0; step < 2 * capacity; step++) {
+            Frame& frame = frames[clockHand];
+            uint32_t current = static_cast<uint32_t>(clockHand);
+            clockHand = (clockHand + 1) % capacity;
+
+            if (frame.pinned) {
+                continue;
+            }
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+
+            if (frame.dirty) {
+                writeBack(frame.key, frame.page);
+            }
+            frameIndex->remove(frame.key);
+            frame.valid = false;
+            frame.dirty = false;
+            used--;
+            evictions++;
+
+            victim = current;
+            return true;
+        }
+
+        return false;
+    }
+
+    void resetFreeFrames() {
+        freeFrames.clear();
+        for (size_t i = capacity; i > 0; i--) {
+            freeFrames.push_back(static_cast<uint32_t>(i - 1));
+        }
+    }
+
+public:
+    PageCache(size_t cap, function<void(uint64_t, const PageType&)> writer)
+        : capacity(cap == 0 ? 1 : cap), used(0), clockHand(0), writeBack(writer),
+        hits(0), misses(0), evictions(0) {
+        frames.resize(capacity);
+        resetFreeFrames();
+        frameIndex = new HashTable<uint64_t, uint32_t>(capacity * 2 + 1);
+        pinnedKeys = new HashTable<uint64_t, bool>(HASH_TABLE_SIZE);
+    }
+
+    ~PageCache() {
+        delete frameIndex;
+        delete pinnedKeys;
+    }
+
+    bool get(uint64_t key, PageType& page) {
+        lock_guard<mutex> lock(cacheMutex);
+
+        uint32_t slot;
+        if (!frameIndex->find(key, slot)) {
+            misses++;
+            return false;
+        }
+
+        frames[slot].referenced = true;
+        page = frames[slot].page;
+        hits++;
+        return true;
+    }
+
+    void put(uint64_t key, const PageType& page, bool dirty, bool pinned = false) {
+        lock_guard<mutex> lock(cacheMutex);
+
+        uint32_t slot;
+        if (frameIndex->find(key, slot)) {
+            // A clean copy never replaces a cached page, which may be newer.
+            Frame& frame = frames[slot];
+            if (dirty) {
+                frame.page = page;
+                frame.dirty = true;
+            }
+            frame.referenced = true;
+            frame.pinned = frame.pinned || pinned;
+            return;
+        }
+
+        if (!findVictim(slot)) {
+            // Every frame is pinned, so the page bypasses the cache.
+            if (dirty) {
+                writeBack(key, page);
+            }
+            return;
+        }
+
+        Frame& frame = frames[slot];
+        frame.key = key;
+        frame.page = page;
+        frame.valid = true;
+        frame.dirty = dirty;
+        frame.referenced = true;
+        frame.pinned = pinned || pinnedKeys->contains(key);
+        frameIndex->insert(key, slot);
+        used++;
+    }
+
+    // Pins the page now if it is cached, or as soon as it is loaded.
+    void pin(uint64_t key) {
+        lock_guard<mutex> lock(cacheMutex);
+        pinnedKeys->insert(key, true);
+
+        uint32_t slot;
+        if (frameIndex->find(key, slot)) {
+            frames[slot].pinned = true;
+        }
+    }
+
+    void unpinAll() {
+        lock_guard<mutex> lock(cacheMutex);
+        for (size_t i = 0; i < capacity; i++) {
+            frames[i].pinned = false;
+        }
+        pinnedKeys->clear();
+    }
+
+    void erase(uint64_t key) {
+        lock_guard<mutex> lock(cacheMutex);
+        uint32_t slot;
+        if (frameIndex->find(key, slot)) {
+            frames[slot].valid = false;
+            frames[slot].dirty = false;
+            frames[slot].pinned = false;
+            frameIndex->remove(key);
+            freeFrames.push_back(slot);
+            used--;
+        }
+        pinnedKeys->remove(key);
+    }
+
+    void flush() {
+        lock_guard<mutex> lock(cacheMutex);
+        for (size_t i = 0; i < capacity; i++) {
+            Frame& frame = frames[i];
+            if (frame.valid && frame.dirty) {
+                writeBack(frame.key, frame.page);
+                frame.dirty = false;
+            }
+        }
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(cacheMutex);
+        for (size_t i = 0; i < capacity; i++) {
+            frames[i].valid = false;
+            frames[i].dirty = false;
+            frames[i].pinned = false;
+        }
+        frameIndex->clear();
+        pinnedKeys->clear();
+        resetFreeFrames();
+        used = 0;
+        clockHand = 0;
+    }
+
+    uint64_t getHits() const {
+        lock_guard<mutex> lock(cacheMutex);
+        return hits;
+    }
+
+    uint64_t getMisses() const {
+        lock_guard<mutex> lock(cacheMutex);
+        return misses;
+    }
+
+    uint64_t getEvictions() const {
+        lock_guard<mutex> lock(cacheMutex);
+        return evictions;
+    }
+
+    size_t getSize() const {
+        lock_guard<mutex> lock(cacheMutex);
+        return used;
+    }
+
+    size_t getCapacity() const {
+        return capacity;
+    }
+};
+
+#endif
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
 
 using namespace std;
 
@@ -60,33 +61,27 @@ private:
     }
 
     void flushUserBuffers(HashTable<uint32_t, vector<RatingEdge>*>& buffers) {
-        vector<pair<uint32_t, vector<RatingEdge>*>> users = buffers.getAllPairs();
-
-        for (const auto& p : users) {
-            uint32_t uid = p.first;
-            vector<RatingEdge>* newRatings = p.second;
-
-            vector<RatingEdge> existingRatings = engine->edgeManager->readRatings(uid);
-
-            existingRatings.insert(existingRatings.end(), newRatings->begin(), newRatings->end());
-
-            engine->edgeManager->writeRatings(uid, existingRatings);
+        buffers.forEach([this](uint32_t uid, vector<RatingEdge>* newRatings) {
+            size_t ratingCount = engine->edgeManager->appendRatings(uid, *newRatings);
 
             try {
                 User u = engine->graphDB->getUser(uid);
-                u.totalRatings = existingRatings.size();
+                u.totalRatings = ratingCount;
                 engine->graphDB->updateUser(uid, u);
             }
             catch (...) {}
 
             delete newRatings;
-        }
+        });
 
         buffers.clear();
     }
 
     void flushMovieStats(HashTable<uint32_t, pair<uint32_t, uint32_t>*>& stats) {
+        // In ID order: updateMovie re-appends a movie to its genre lists,
+        // which keeps them sorted the way rebuildIndices() builds them.
         vector<pair<uint32_t, pair<uint32_t, uint32_t>*>> movies = stats.getAllPairs();
+        sort(movies.begin(), movies.end());
 
         for (const auto& p : movies) {
             uint32_t mid = p.first;
@@ -124,6 +119,7 @@ public:
         int count = 0;
         int errors = 0;
         string line;
+        vector<Movie> movies;
 
         while (getline(file, line)) {
             try {
@@ -138,7 +134,8 @@ public:
                 string title = trim(parts[1]);
                 vector<string> genres = extractGenres(parts);
 
-                engine->addMovie(movieID, title, genres);
+                engine->validateMovie(title, genres);
+                movies.push_back(Movie(movieID, title, genres));
                 count++;
 
                 if (count % 500 == 0) {
@@ -151,6 +148,15 @@ public:
         }
 
         file.close();
+
+        try {
+            engine->addMovies(movies);
+        }
+        catch (const exception& e) {
+            cerr << "[ERROR] " << e.what() << endl;
+            return false;
+        }
+
         cout << "[OK] Loaded " << count << " movies (" << errors << " errors)" << endl;
         return true;
     }
@@ -169,6 +175,7 @@ public:
         int count = 0;
         int errors = 0;
         string line;
+        vector<pair<uint32_t, string>> users;
 
         while (getline(file, line)) {
             try {
@@ -189,7 +196,8 @@ public:
                 catch (const exception& e) {
                 }
 
-                engine->createUser(userID, username);
+                engine->validateUsername(username);
+                users.push_back(make_pair(userID, username));
                 count++;
 
                 if (count % 200 == 0) {
@@ -202,6 +210,15 @@ public:
         }
 
         file.close();
+
+        try {
+            engine->createUsers(users);
+        }
+        catch (const exception& e) {
+            cerr << "[ERROR] " << e.what() << endl;
+            return false;
+        }
+
         cout << "[OK] Loaded " << count << " users (" << errors << " errors)" << endl;
         cout << "[INFO] Default password for all users: movielens123" << endl;
         return true;
@@ -287,6 +304,9 @@ public:
         if (!parseUsers()) return false;
         if (!parseRatings()) return false;
 
+        engine->edgeManager->merge();
+        engine->flush();
+
         cout << "\n========================================" << endl;
         cout << " Parsing Complete!" << endl;
         cout << "========================================" << endl;
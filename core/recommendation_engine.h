@@ -4,6 +4,7 @@
 #include "../graph/graph_database.h"
 #include "storage_manager.h"
 #include "hash_table.h"
+#include "concurrent_hash_map.h"
 #include <queue> 
 #include <cmath>
 #include <algorithm>
@@ -13,30 +14,32 @@ using namespace std;
 
 class MovieLockManager {
 private:
-    HashTable<uint32_t, mutex*>* locks;
-    mutex managerMutex;
+    ConcurrentHashMap<uint32_t, mutex*>* locks;
 
 public:
     MovieLockManager() {
-        locks = new HashTable<uint32_t, mutex*>(2003);
+        locks = new ConcurrentHashMap<uint32_t, mutex*>(2003);
     }
 
     ~MovieLockManager() {
-        vector<pair<uint32_t, mutex*>> allLocks = locks->getAllPairs();
-        for (const auto& p : allLocks) {
-            delete p.second;
-        }
+        locks->forEach([](uint32_t, mutex* m) {
+            delete m;
+        });
         delete locks;
     }
 
     mutex& getLock(uint32_t movieID) {
-        lock_guard<mutex> guard(managerMutex);
-
-        mutex* m;
-        if (!locks->find(movieID, m)) {
-            m = new mutex();
-            locks->insert(movieID, m);
+        mutex* m = nullptr;
+        if (locks->find(movieID, m)) {
+            return *m;
         }
+
+        locks->update(movieID, [&m](mutex*& stored) {
+            if (stored == nullptr) {
+                stored = new mutex();
+            }
+            m = stored;
+        });
         return *m;
     }
 };
@@ -64,20 +67,20 @@ struct RecommendationResult {
 };
 
 struct UserProfile {
-    HashTable<string, float>* genreScores;
+    // Indexed by GenreDictionary ID.
+    float genreScores[MAX_GENRE_IDS];
     HashTable<uint32_t, bool>* ratedMovies;
     float avgUserRating;
     uint32_t totalRatings;
 
     UserProfile() {
-        genreScores = new HashTable<string, float>(211);
+        fill(genreScores, genreScores + MAX_GENRE_IDS, 0.0f);
         ratedMovies = new HashTable<uint32_t, bool>(1009);
         avgUserRating = 0.0f;
         totalRatings = 0;
     }
 
     ~UserProfile() {
-        delete genreScores;
         delete ratedMovies;
     }
 };
@@ -102,13 +105,28 @@ private:
         }
     }
 
+    void validateUsername(const string& username) const {
+        if (username.empty() || username.length() >= MAX_USERNAME_LENGTH) {
+            throw runtime_error("Invalid username");
+        }
+    }
+
+    void validateMovie(const string& title, const vector<string>& genres) const {
+        if (title.empty() || title.length() >= MAX_TITLE_LENGTH) {
+            throw runtime_error("Invalid movie title");
+        }
+        if (genres.empty() || genres.size() > MAX_GENRES) {
+            throw runtime_error("Invalid genres");
+        }
+    }
+
     void validateRating(float rating) const {
         if (rating < MIN_RATING || rating > MAX_RATING) {
             throw runtime_error("Rating must be between 1.0 and 5.0");
         }
     }
 
-    float calculateMovieScore(const Movie& movie, const UserProfile& profile) {
+    float calculateMovieScore(const MovieStats& movie, const UserProfile& profile) {
         bool alreadyRated = false;
         if (profile.ratedMovies->find(movie.movieID, alreadyRated)) {
             return -1.0f;
@@ -118,22 +136,20 @@ private:
             return -1.0f;
         }
 
-        vector<string> movieGenres = movie.getGenres();
-        if (movieGenres.empty()) {
+        if (movie.genreMask == 0) {
             return -1.0f;
         }
 
+        // The first genre counts extra.
         float genreMatchScore = 0.0f;
-        for (size_t i = 0; i < movieGenres.size(); i++) {
-            float userGenreScore = 0.0f;
-            profile.genreScores->find(movieGenres[i], userGenreScore);
-
-            float genreWeight = 1.0f;
-            if (i == 0) {
-                genreWeight = 1.5f;
+        if (movie.primaryGenre != MovieCatalog::NO_GENRE) {
+            genreMatchScore = profile.genreScores[movie.primaryGenre] * 1.5f;
+        }
+        for (uint64_t mask = movie.genreMask; mask != 0; mask = mask & (mask - 1)) {
+            uint32_t genre = static_cast<uint32_t>(__builtin_ctzll(mask));
+            if (genre != movie.primaryGenre) {
+                genreMatchScore = genreMatchScore + profile.genreScores[genre];
             }
-
-            genreMatchScore = genreMatchScore + (userGenreScore * genreWeight);
         }
 
         if (genreMatchScore <= 0.0f) {
@@ -165,32 +181,32 @@ private:
         }
         profile->avgUserRating = ratingSum / profile->totalRatings;
 
+        vector<uint32_t> movieIDs;
+        movieIDs.reserve(userRatings.size());
         for (size_t i = 0; i < userRatings.size(); i++) {
-            RatingEdge rating = userRatings[i];
+            movieIDs.push_back(userRatings[i].movieID);
+        }
 
-            try {
-                Movie movie = graphDB->getMovie(rating.movieID);
-                float userRating = rating.getRating();
-                vector<string> genres = movie.getGenres();
+        vector<MovieStats> movies = graphDB->getCatalog().getMany(movieIDs);
 
-                float ratingWeight = userRating - profile->avgUserRating;
+        for (size_t i = 0; i < userRatings.size(); i++) {
+            const MovieStats& movie = movies[i];
+            if (movie.movieID == 0) {
+                continue;
+            }
 
-                for (size_t j = 0; j < genres.size(); j++) {
-                    string genre = genres[j];
-                    float existingScore = 0.0f;
-                    profile->genreScores->find(genre, existingScore);
+            float userRating = userRatings[i].getRating();
+            float ratingWeight = userRating - profile->avgUserRating;
 
-                    float genreWeight = 1.0f;
-                    if (j == 0) {
-                        genreWeight = 2.0f;
-                    }
+            for (uint64_t mask = movie.genreMask; mask != 0; mask = mask & (mask - 1)) {
+                uint32_t genre = static_cast<uint32_t>(__builtin_ctzll(mask));
 
-                    float newScore = existingScore + (userRating * ratingWeight * genreWeight);
-                    profile->genreScores->insert(genre, newScore);
+                float genreWeight = 1.0f;
+                if (genre == movie.primaryGenre) {
+                    genreWeight = 2.0f;
                 }
-            }
-            catch (...) {
-                continue;
+
+                profile->genreScores[genre] = profile->genreScores[genre] + userRating * ratingWeight * genreWeight;
             }
         }
 
@@ -205,24 +221,28 @@ private:
         }
         reverse(topMovies.begin(), topMovies.end());
 
+        vector<uint32_t> movieIDs;
+        for (size_t i = 0; i < topMovies.size(); i++) {
+            movieIDs.push_back(topMovies[i].movieID);
+        }
+        vector<Movie> movies = graphDB->getMovies(movieIDs);
+
         vector<RecommendationResult> results;
         for (size_t i = 0; i < topMovies.size(); i++) {
-            try {
-                Movie movie = graphDB->getMovie(topMovies[i].movieID);
-
-                RecommendationResult result;
-                result.movieID = topMovies[i].movieID;
-                result.title = movie.getTitle();
-                result.genres = movie.getGenres();
-                result.score = topMovies[i].score;
-                result.avgRating = movie.getAvgRating();
-                result.ratingCount = movie.ratingCount;
-
-                results.push_back(result);
-            }
-            catch (...) {
+            const Movie& movie = movies[i];
+            if (movie.movieID == 0) {
                 continue;
             }
+
+            RecommendationResult result;
+            result.movieID = topMovies[i].movieID;
+            result.title = movie.getTitle();
+            result.genres = movie.getGenres();
+            result.score = topMovies[i].score;
+            result.avgRating = movie.getAvgRating();
+            result.ratingCount = movie.ratingCount;
+
+            results.push_back(result);
         }
 
         return results;
@@ -236,19 +256,19 @@ private:
             return vector<RecommendationResult>();
         }
 
-        vector<pair<string, float>> topGenres;
-        vector<pair<string, float>> allGenreScores = profile->genreScores->getAllPairs();
-
-        sort(allGenreScores.begin(), allGenreScores.end(),
-            [](const pair<string, float>& a, const pair<string, float>& b) {
-                return a.second > b.second;
-            });
-
-        for (size_t i = 0; i < min((size_t)5, allGenreScores.size()); i++) {
-            if (allGenreScores[i].second > 0) {
-                topGenres.push_back(allGenreScores[i]);
+        // Up to five genres with the highest positive scores.
+        vector<pair<uint32_t, float>> topGenres;
+        for (uint32_t genre = 0; genre < MAX_GENRE_IDS; genre++) {
+            if (profile->genreScores[genre] > 0) {
+                topGenres.push_back(make_pair(genre, profile->genreScores[genre]));
             }
         }
+        size_t keep = min((size_t)5, topGenres.size());
+        partial_sort(topGenres.begin(), topGenres.begin() + keep, topGenres.end(),
+            [](const pair<uint32_t, float>& a, const pair<uint32_t, float>& b) {
+                return a.second > b.second;
+            });
+        topGenres.resize(keep);
 
         set<uint32_t> candidates;
         for (const auto& genrePair : topGenres) {
@@ -260,37 +280,37 @@ private:
         }
 
         if (candidates.empty()) {
-            vector<uint32_t> allMovies = graphDB->getAllMovieIDs();
-            for (size_t i = 0; i < min((size_t)200, allMovies.size()); i++) {
-                candidates.insert(allMovies[i]);
+            vector<uint32_t> firstMovies = graphDB->getMovieIDs(0, 200);
+            for (size_t i = 0; i < firstMovies.size(); i++) {
+                candidates.insert(firstMovies[i]);
             }
         }
 
         priority_queue<MovieScore, vector<MovieScore>, greater<MovieScore>> minHeap;
 
-        for (uint32_t movieID : candidates) {
-            try {
-                Movie movie = graphDB->getMovie(movieID);
-                float score = calculateMovieScore(movie, *profile);
+        vector<MovieStats> movies = graphDB->getCatalog().getMany(vector<uint32_t>(candidates.begin(), candidates.end()));
 
-                if (score < 0) continue;
+        for (const MovieStats& movie : movies) {
+            if (movie.movieID == 0) {
+                continue;
+            }
 
-                if (minHeap.size() < (size_t)topN) {
-                    MovieScore ms;
-                    ms.movieID = movieID;
-                    ms.score = score;
-                    minHeap.push(ms);
-                }
-                else if (score > minHeap.top().score) {
-                    minHeap.pop();
-                    MovieScore ms;
-                    ms.movieID = movieID;
-                    ms.score = score;
-                    minHeap.push(ms);
-                }
+            float score = calculateMovieScore(movie, *profile);
+
+            if (score < 0) continue;
+
+            if (minHeap.size() < (size_t)topN) {
+                MovieScore ms;
+                ms.movieID = movie.movieID;
+                ms.score = score;
+                minHeap.push(ms);
             }
-            catch (...) {
-                continue;
+            else if (score > minHeap.top().score) {
+                minHeap.pop();
+                MovieScore ms;
+                ms.movieID = movie.movieID;
+                ms.score = score;
+                minHeap.push(ms);
             }
         }
 
@@ -330,32 +350,32 @@ public:
             priority_queue<MovieScore, vector<MovieScore>, greater<MovieScore>> topMovies;
 
             size_t examineCount = min(ids.size(), (size_t)50);
+            ids.resize(examineCount);
+            vector<MovieStats> movies = graphDB->getCatalog().getMany(ids);
 
             for (size_t i = 0; i < examineCount; i++) {
-                try {
-                    Movie m = getMovie(ids[i]);
-
-                    if (m.ratingCount < 10) continue;
-
-                    if (addedMovies.find(ids[i]) != addedMovies.end()) continue;
-
-                    float score = m.getAvgRating();
-
-                    if (topMovies.size() < (size_t)limitPerGenre) {
-                        MovieScore ms;
-                        ms.movieID = ids[i];
-                        ms.score = score;
-                        topMovies.push(ms);
-                    }
-                    else if (score > topMovies.top().score) {
-                        topMovies.pop();
-                        MovieScore ms;
-                        ms.movieID = ids[i];
-                        ms.score = score;
-                        topMovies.push(ms);
-                    }
+                const MovieStats& m = movies[i];
+                if (m.movieID == 0) continue;
+
+                if (m.ratingCount < 10) continue;
+
+                if (addedMovies.find(ids[i]) != addedMovies.end()) continue;
+
+                float score = m.getAvgRating();
+
+                if (topMovies.size() < (size_t)limitPerGenre) {
+                    MovieScore ms;
+                    ms.movieID = ids[i];
+                    ms.score = score;
+                    topMovies.push(ms);
+                }
+                else if (score > topMovies.top().score) {
+                    topMovies.pop();
+                    MovieScore ms;
+                    ms.movieID = ids[i];
+                    ms.score = score;
+                    topMovies.push(ms);
                 }
-                catch (...) {}
             }
 
             if (!topMovies.empty()) {
@@ -412,25 +432,33 @@ public:
 
         vector<uint32_t> movieIDs = graphDB->searchMoviesByTitle(query);
 
-        for (uint32_t id : movieIDs) {
-            try {
-                matches.push_back(graphDB->getMovie(id));
+        for (const Movie& movie : graphDB->getMovies(movieIDs)) {
+            if (movie.movieID != 0) {
+                matches.push_back(movie);
             }
-            catch (...) {}
         }
 
         return matches;
     }
 
     void createUser(uint32_t userID, const string& username) {
-        if (username.empty() || username.length() >= MAX_USERNAME_LENGTH) {
-            throw runtime_error("Invalid username");
-        }
+        validateUsername(username);
 
         edgeManager->deleteUserEdges(userID);
         graphDB->addUser(userID, username);
     }
 
+    void createUsers(const vector<pair<uint32_t, string>>& users) {
+        for (const auto& user : users) {
+            validateUsername(user.second);
+        }
+
+        for (const auto& user : users) {
+            edgeManager->deleteUserEdges(user.first);
+        }
+        graphDB->addUsers(users);
+    }
+
     User getUserProfile(uint32_t userID) {
         return graphDB->getUser(userID);
     }
@@ -449,16 +477,19 @@ public:
     }
 
     void addMovie(uint32_t movieID, const string& title, const vector<string>& genres) {
-        if (title.empty() || title.length() >= MAX_TITLE_LENGTH) {
-            throw runtime_error("Invalid movie title");
-        }
-        if (genres.empty() || genres.size() > MAX_GENRES) {
-            throw runtime_error("Invalid genres");
-        }
+        validateMovie(title, genres);
 
         graphDB->addMovie(movieID, title, genres);
     }
 
+    void addMovies(const vector<Movie>& movies) {
+        for (const Movie& movie : movies) {
+            validateMovie(movie.getTitle(), movie.getGenres());
+        }
+
+        graphDB->addMovies(movies);
+    }
+
     Movie getMovie(uint32_t movieID) {
         return graphDB->getMovie(movieID);
     }
@@ -487,9 +518,7 @@ public:
 
 
         float oldRating;
-        bool hadRating = edgeManager->getRating(userID, movieID, oldRating);
-
-        edgeManager->addOrUpdateRating(userID, movieID, rating);
+        bool hadRating = edgeManager->addOrUpdateRating(userID, movieID, rating, oldRating);
 
         {
             lock_guard<mutex> movieLock(movieLocks->getLock(movieID));
@@ -521,10 +550,21 @@ public:
         return edgeManager->readRatings(userID);
     }
 
+    // Everyone who rated the movie; each edge's movieID field holds the
+    // rater's user ID.
+    vector<RatingEdge> getMovieRatings(uint32_t movieID) {
+        return edgeManager->readRaters(movieID);
+    }
+
     bool hasRated(uint32_t userID, uint32_t movieID) {
         return edgeManager->hasRating(userID, movieID);
     }
 
+    // Movies both users rated, with each user's edge, in movie ID order.
+    vector<pair<RatingEdge, RatingEdge>> getCommonRatings(uint32_t userA, uint32_t userB) {
+        return edgeManager->commonRatings(userA, userB);
+    }
+
     vector<RecommendationResult> getRecommendations(uint32_t userID, int topN = 10) {
         if (!userExists(userID)) {
             throw runtime_error("User does not exist");
@@ -536,13 +576,17 @@ public:
     vector<RecommendationResult> recommendPopular(int topN = 10) {
         priority_queue<MovieScore, vector<MovieScore>, greater<MovieScore>> minHeap;
 
-        vector<uint32_t> allMovies = graphDB->getAllMovieIDs();
-
-        for (uint32_t movieID : allMovies) {
-            try {
-                Movie movie = graphDB->getMovie(movieID);
+        // Scanned a batch at a time in ID order.
+        uint32_t fromID = 0;
+        while (true) {
+            vector<uint32_t> batch = graphDB->getMovieIDs(fromID, MOVIE_BATCH_SIZE);
+            if (batch.empty()) {
+                break;
+            }
+            fromID = batch.back() + 1;
 
-                if (movie.ratingCount < 5) {
+            for (const MovieStats& movie : graphDB->getCatalog().getMany(batch)) {
+                if (movie.movieID == 0 || movie.ratingCount < 5) {
                     continue;
                 }
 
@@ -550,30 +594,39 @@ public:
 
                 if (minHeap.size() < (size_t)topN) {
                     MovieScore ms;
-                    ms.movieID = movieID;
+                    ms.movieID = movie.movieID;
                     ms.score = score;
                     minHeap.push(ms);
                 }
                 else if (score > minHeap.top().score) {
                     minHeap.pop();
                     MovieScore ms;
-                    ms.movieID = movieID;
+                    ms.movieID = movie.movieID;
                     ms.score = score;
                     minHeap.push(ms);
                 }
             }
-            catch (...) {
-                continue;
-            }
         }
 
         return extractResults(minHeap);
     }
 
+    void flush() {
+        graphDB->flush();
+        edgeManager->sync();
+    }
+
+    void compact() {
+        graphDB->compactIndices();
+        edgeManager->merge();
+    }
+
     void printStats() {
         cout << "\n\nDatabase:" << endl;
         cout << "  Total Users:  " << graphDB->getUserCount() << endl;
         cout << "  Total Movies: " << graphDB->getMovieCount() << endl;
+        cout << "  Index cache:  " << graphDB->getIndexCacheHits() << " hits, "
+            << graphDB->getIndexCacheMisses() << " misses" << endl;
         cout << "\n----------------------------------------\n" << endl;
     }
 };
@@ -7,87 +7,296 @@
 #include <iostream>
 #include <stdexcept>
 #include <type_traits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <shared_mutex>
 #include "../graph/node.h"
 #include "./types.h"
+#include "./wal.h"
+#include "./bitmap.h"
+#include "./page_cache.h"
+#include "./edge_codec.h"
+#include <mutex>
+#include <atomic>
 #include <filesystem>
 namespace fs = std::filesystem;
 using namespace std;
 
+struct StorageBlock {
+    char bytes[BLOCK_SIZE];
+};
+
+// Records live in dense slots rather than at an offset derived from their
+// ID. The owner maps IDs to slots (GraphDatabase keeps the slot as the
+// index value) and allocates and frees slots here. Slot 0 is never used.
+//
+// The slot map is not written to disk: the owning index is the durable
+// record of which slots are live, so the owner claims them again on open.
+//
+// Reads and writes go through a write-back cache of whole BLOCK_SIZE
+// blocks, so records in the same block share one I/O. A write updates the
+// cached block and logs the record; dirty blocks reach the file on
+// eviction or sync(). With read-ahead set, a miss loads that many blocks
+// in one read, for sequential scans.
 template<typename NodeType>
 class FixedStorage {
 private:
-    fstream file;
+    int fd;
     string filename;
     int nodeSize;
     int nodesPerBlock;
 
+    WriteAheadLog* wal;
+    uint32_t walTarget;
+
+    Bitmap* slotMap;
+    mutex slotMutex;
+
+    PageCache<StorageBlock>* cache;
+    mutex blockMutex;
+    size_t readAhead;
+    atomic<uint64_t> fileBytes;
+
+    void writeBlock(uint64_t block, const StorageBlock& page) {
+        if (pwrite(fd, page.bytes, BLOCK_SIZE, static_cast<off_t>(block * BLOCK_SIZE)) !=
+            static_cast<ssize_t>(BLOCK_SIZE)) {
+            throw runtime_error("Failed to write block to " + filename);
+        }
+    }
+
+    // Caller holds blockMutex. Bytes past the end of the file read as zero.
+    void loadBlock(uint64_t block, StorageBlock& page) {
+        if (cache->get(block, page)) {
+            return;
+        }
+
+        size_t count = readAhead > 1 ? readAhead : 1;
+        vector<StorageBlock> pages(count);
+        ssize_t bytesRead = pread(fd, pages.data(), count * BLOCK_SIZE,
+            static_cast<off_t>(block * BLOCK_SIZE));
+        if (bytesRead < 0) {
+            throw runtime_error("Failed to read block from " + filename);
+        }
+        memset(reinterpret_cast<char*>(pages.data()) + bytesRead, 0, count * BLOCK_SIZE - bytesRead);
+
+        page = pages[0];
+        cache->put(block, page, false);
+        for (size_t i = 1; i < count && i * BLOCK_SIZE < static_cast<size_t>(bytesRead); i++) {
+            cache->put(block + i, pages[i], false);
+        }
+    }
+
+    uint64_t offsetOf(uint32_t slot) const {
+        uint32_t blockNum = slot / nodesPerBlock;
+        uint32_t posInBlock = slot % nodesPerBlock;
+        return static_cast<uint64_t>(blockNum) * BLOCK_SIZE + posInBlock * nodeSize;
+    }
+
 public:
     FixedStorage(const string& fname, int nSize, int nPerBlock)
-        : filename(fname), nodeSize(nSize), nodesPerBlock(nPerBlock) {
+        : fd(-1), filename(fname), nodeSize(nSize), nodesPerBlock(nPerBlock), wal(nullptr), walTarget(0) {
 
-        file.open(filename, ios::in | ios::out | ios::binary);
-        if (!file.is_open()) {
-            file.open(filename, ios::out | ios::binary);
-            file.close();
-            file.open(filename, ios::in | ios::out | ios::binary);
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open " + filename);
         }
+
+        off_t size = lseek(fd, 0, SEEK_END);
+        fileBytes = size > 0 ? static_cast<uint64_t>(size) : 0;
+
+        slotMap = new Bitmap(nodesPerBlock);
+        readAhead = 0;
+        cache = new PageCache<StorageBlock>(STORAGE_CACHE_BLOCKS,
+            [this](uint64_t block, const StorageBlock& page) {
+                if (wal != nullptr) {
+                    wal->sync();
+                }
+                writeBlock(block, page);
+            });
     }
 
     ~FixedStorage() {
-        if (file.is_open()) {
-            file.close();
+        cache->flush();
+        delete cache;
+        delete slotMap;
+
+        if (fd >= 0) {
+            ::close(fd);
         }
     }
 
-    void writeNode(uint32_t nodeID, const NodeType& node) {
-        uint32_t blockNum = nodeID / nodesPerBlock;
-        uint32_t posInBlock = nodeID % nodesPerBlock;
-        uint64_t offset = blockNum * BLOCK_SIZE + posInBlock * nodeSize;
+    // Lowest free slot, so the file stays dense and freed slots are reused.
+    uint32_t allocateSlot() {
+        lock_guard<mutex> lock(slotMutex);
 
-        char buffer[MOVIE_NODE_SIZE];
-        memset(buffer, 0, nodeSize);
-        node.serialize(buffer);
+        size_t slot = slotMap->findFreeBlock();
+        if (slot >= slotMap->getNumBlocks()) {
+            if (slot > MAX_SLOTS) {
+                throw runtime_error("No free slots in " + filename);
+            }
+            slotMap->resize(2 * slotMap->getNumBlocks());
+        }
+        slotMap->setBit(slot);
+        return static_cast<uint32_t>(slot);
+    }
+
+    // Marks a slot that an index already refers to as in use.
+    void claimSlot(uint32_t slot) {
+        lock_guard<mutex> lock(slotMutex);
+
+        if (slot >= slotMap->getNumBlocks()) {
+            slotMap->resize(2 * static_cast<size_t>(slot));
+        }
+        slotMap->setBit(slot);
+    }
 
-        file.seekp(offset, ios::beg);
-        file.write(buffer, nodeSize);
-        file.flush();
+    void freeSlot(uint32_t slot) {
+        lock_guard<mutex> lock(slotMutex);
 
-        if (file.fail()) {
-            throw runtime_error("Failed to write node");
+        if (slot != 0 && slot < slotMap->getNumBlocks()) {
+            slotMap->clearBit(slot);
         }
     }
 
-    NodeType readNode(uint32_t nodeID) {
-        uint32_t blockNum = nodeID / nodesPerBlock;
-        uint32_t posInBlock = nodeID % nodesPerBlock;
-        uint64_t offset = blockNum * BLOCK_SIZE + posInBlock * nodeSize;
+    void attachLog(WriteAheadLog* log) {
+        wal = log;
+        walTarget = wal->registerTarget(filename);
+    }
+
+    // Blocks read ahead of a miss; 0 or 1 reads only the missed block.
+    void setReadAhead(size_t blocks) {
+        lock_guard<mutex> lock(blockMutex);
+        readAhead = blocks;
+    }
+
+    // Durability comes from the log record appended with each write, or
+    // from sync().
+    void writeNode(uint32_t slot, const NodeType& node) {
+        uint64_t offset = offsetOf(slot);
 
         char buffer[MOVIE_NODE_SIZE];
         memset(buffer, 0, nodeSize);
+        node.serialize(buffer);
+
+        lock_guard<mutex> lock(blockMutex);
 
-        file.seekg(offset, ios::beg);
-        file.read(buffer, nodeSize);
+        // Logged before the block is cached dirty, so write-back never
+        // reaches the file ahead of the record.
+        if (wal != nullptr) {
+            WriteAheadLog::Batch batch;
+            batch.add(walTarget, offset, buffer, static_cast<uint32_t>(nodeSize));
+            wal->append(batch);
+        }
+
+        StorageBlock page;
+        loadBlock(offset / BLOCK_SIZE, page);
+        memcpy(page.bytes + offset % BLOCK_SIZE, buffer, nodeSize);
+        cache->put(offset / BLOCK_SIZE, page, true);
+
+        if (offset + nodeSize > fileBytes) {
+            fileBytes = offset + nodeSize;
+        }
+    }
 
-        if (file.fail()) {
+    NodeType readNode(uint32_t slot) {
+        uint64_t offset = offsetOf(slot);
+        if (offset + nodeSize > fileBytes) {
             throw runtime_error("Failed to read node");
         }
 
-        return NodeType::deserialize(buffer);
+        StorageBlock page;
+        {
+            lock_guard<mutex> lock(blockMutex);
+            loadBlock(offset / BLOCK_SIZE, page);
+        }
+        return NodeType::deserialize(page.bytes + offset % BLOCK_SIZE);
     }
 
-    bool exists(uint32_t nodeID) {
-        try {
-            NodeType node = readNode(nodeID);
-            return node.id == nodeID;
+    // Reads many records at once. Their blocks are visited in file order:
+    // cached blocks are copied, and each run of adjacent missing blocks is
+    // fetched with a single preadv. Results follow the order of slots.
+    vector<NodeType> readNodes(const vector<uint32_t>& slots) {
+        vector<uint64_t> blocks;
+        blocks.reserve(slots.size());
+        for (uint32_t slot : slots) {
+            uint64_t offset = offsetOf(slot);
+            if (offset + nodeSize > fileBytes) {
+                throw runtime_error("Failed to read node");
+            }
+            blocks.push_back(offset / BLOCK_SIZE);
         }
-        catch (...) {
-            return false;
+        sort(blocks.begin(), blocks.end());
+        blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+
+        vector<StorageBlock> pages(blocks.size());
+        {
+            lock_guard<mutex> lock(blockMutex);
+
+            vector<size_t> missing;
+            for (size_t i = 0; i < blocks.size(); i++) {
+                if (!cache->get(blocks[i], pages[i])) {
+                    missing.push_back(i);
+                }
+            }
+
+            size_t run = 0;
+            while (run < missing.size()) {
+                size_t end = run + 1;
+                while (end < missing.size() && end - run < IOV_MAX &&
+                    blocks[missing[end]] == blocks[missing[end - 1]] + 1) {
+                    end++;
+                }
+
+                vector<iovec> iov(end - run);
+                for (size_t k = 0; k < iov.size(); k++) {
+                    iov[k].iov_base = pages[missing[run + k]].bytes;
+                    iov[k].iov_len = BLOCK_SIZE;
+                }
+
+                ssize_t bytesRead = preadv(fd, iov.data(), static_cast<int>(iov.size()),
+                    static_cast<off_t>(blocks[missing[run]] * BLOCK_SIZE));
+                if (bytesRead < 0) {
+                    throw runtime_error("Failed to read blocks from " + filename);
+                }
+
+                for (size_t k = 0; k < iov.size(); k++) {
+                    StorageBlock& page = pages[missing[run + k]];
+                    size_t filled = static_cast<size_t>(bytesRead) > k * BLOCK_SIZE ?
+                        min(BLOCK_SIZE, static_cast<size_t>(bytesRead) - k * BLOCK_SIZE) : 0;
+                    memset(page.bytes + filled, 0, BLOCK_SIZE - filled);
+                    cache->put(blocks[missing[run + k]], page, false);
+                }
+                run = end;
+            }
         }
+
+        vector<NodeType> nodes;
+        nodes.reserve(slots.size());
+        for (uint32_t slot : slots) {
+            uint64_t offset = offsetOf(slot);
+            size_t index = lower_bound(blocks.begin(), blocks.end(), offset / BLOCK_SIZE) - blocks.begin();
+            nodes.push_back(NodeType::deserialize(pages[index].bytes + offset % BLOCK_SIZE));
+        }
+        return nodes;
+    }
+
+    // Writes back dirty blocks and makes them durable.
+    void sync() {
+        cache->flush();
+        fdatasync(fd);
+    }
+
+    bool exists(uint32_t slot) {
+        lock_guard<mutex> lock(slotMutex);
+        return slot < slotMap->getNumBlocks() && !slotMap->isFree(slot);
     }
 
     void printStats() {
-        file.seekg(0, ios::end);
-        uint64_t fileSize = file.tellg();
+        uint64_t fileSize = static_cast<uint64_t>(lseek(fd, 0, SEEK_END));
         uint64_t numBlocks = (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
         cout << "File: " << filename << endl;
@@ -96,130 +305,734 @@ public:
         cout << "  Node size: " << nodeSize << " bytes" << endl;
         cout << "  Nodes per block: " << nodesPerBlock << endl;
         cout << "  Max nodes: " << (numBlocks * nodesPerBlock) << endl;
+        cout << "  Slots in use: " << (slotMap->getNumBlocks() - slotMap->countFree() - 1) << endl;
+        cout << "  Block cache: " << cache->getHits() << " hits, " << cache->getMisses() << " misses" << endl;
     }
 };
 
 
-class EdgeFileManager {
+static_assert(sizeof(RatingEdge) == RatingEdge::getSize(), "RatingEdge must pack to its serialized size");
+
+// One direction of the rating graph in CSR form: a read-only mapped file
+// holding a header, an offsets array with one entry per owner ID plus one,
+// and every owner's edges back to back as EdgeCodec blocks sorted by
+// neighbour. Owners touched since the file was written have a pending
+// list in memory that takes the place of their block, with an index from
+// (owner, neighbour) to the edge's position in it, so setting or removing
+// an edge is O(1) however many the owner has. A list that falls out of
+// neighbour order is sorted when it is read, so every owner's edges still
+// come out in neighbour order.
+//
+// The edge's movieID field holds the neighbour: the movie in the store
+// keyed by user, the rating user in the store keyed by movie.
+//
+// Version 1 files held raw RatingEdge records, with offsets counting
+// edges rather than bytes. They are still read and are rewritten in the
+// current format by the next merge.
+class EdgeStore {
 private:
-    fs::path baseDir;
+    static const size_t HEADER_SIZE = 32;
+    static const uint32_t RAW_EDGES_VERSION = 1;
+
+    string path;
+
+    char* baseMap;
+    size_t baseBytes;
+    uint32_t baseVersion;
+    uint64_t ownerCount;
+    const uint64_t* offsets;
+    const char* baseData;
 
-    string getEdgeFilename(uint32_t userID) const {
-        fs::path fullPath = baseDir / ("user_" + to_string(userID) + ".edges");
-        return fullPath.string();
+    struct PendingList {
+        vector<RatingEdge> edges;
+        bool sorted;
+    };
+
+    HashTable<uint32_t, PendingList*>* pending;
+    HashTable<uint64_t, uint32_t>* positions;
+
+    static uint64_t edgeKey(uint32_t owner, uint32_t neighbour) {
+        return (static_cast<uint64_t>(owner) << 32) | neighbour;
+    }
+
+    static bool byNeighbour(const RatingEdge& a, const RatingEdge& b) {
+        return a.movieID < b.movieID;
+    }
+
+    static vector<RatingEdge>::iterator lowerBound(vector<RatingEdge>& list, uint32_t neighbour) {
+        RatingEdge probe;
+        probe.movieID = neighbour;
+        return lower_bound(list.begin(), list.end(), probe, byNeighbour);
+    }
+
+    static void writeAll(int fd, const char* data, size_t length, const string& target) {
+        while (length > 0) {
+            ssize_t written = ::write(fd, data, length);
+            if (written <= 0) {
+                throw runtime_error("Failed to write " + target);
+            }
+            data = data + written;
+            length = length - static_cast<size_t>(written);
+        }
+    }
+
+    void unmap() {
+        if (baseMap != nullptr) {
+            munmap(baseMap, baseBytes);
+            baseMap = nullptr;
+        }
+        baseBytes = 0;
+        baseVersion = EDGE_STORE_VERSION;
+        ownerCount = 0;
+        offsets = nullptr;
+        baseData = nullptr;
+    }
+
+    void baseEdges(uint32_t owner, vector<RatingEdge>& out) const {
+        out.clear();
+        if (owner >= ownerCount) {
+            return;
+        }
+
+        uint64_t start = offsets[owner];
+        uint64_t end = offsets[owner + 1];
+        if (baseVersion == RAW_EDGES_VERSION) {
+            const RatingEdge* raw = reinterpret_cast<const RatingEdge*>(baseData);
+            out.assign(raw + start, raw + end);
+            sort(out.begin(), out.end(), byNeighbour);
+            return;
+        }
+        EdgeCodec::decode(baseData + start, static_cast<size_t>(end - start), out);
+    }
+
+    size_t baseCount(uint32_t owner) const {
+        if (owner >= ownerCount) {
+            return 0;
+        }
+
+        uint64_t start = offsets[owner];
+        uint64_t end = offsets[owner + 1];
+        if (baseVersion == RAW_EDGES_VERSION) {
+            return static_cast<size_t>(end - start);
+        }
+        return EdgeCodec::count(baseData + start, static_cast<size_t>(end - start));
+    }
+
+    // The owner's pending list, seeded from the base on first change.
+    PendingList* pendingList(uint32_t owner) {
+        PendingList* list;
+        if (!pending->find(owner, list)) {
+            list = new PendingList();
+            baseEdges(owner, list->edges);
+            list->sorted = true;
+            pending->insert(owner, list);
+            for (size_t i = 0; i < list->edges.size(); i++) {
+                positions->insert(edgeKey(owner, list->edges[i].movieID), static_cast<uint32_t>(i));
+            }
+        }
+        return list;
+    }
+
+    void dropPending() {
+        pending->forEach([](uint32_t, PendingList* list) {
+            delete list;
+        });
+        pending->clear();
+        positions->clear();
     }
 
 public:
-    EdgeFileManager(const string& dir = "ratings") : baseDir(dir) {
-        if (!fs::exists(baseDir)) {
-            fs::create_directories(baseDir);
+    EdgeStore(const string& file) : path(file), baseMap(nullptr) {
+        pending = new HashTable<uint32_t, PendingList*>(HASH_TABLE_SIZE);
+        positions = new HashTable<uint64_t, uint32_t>(HASH_TABLE_SIZE);
+        unmap();
+        load();
+    }
+
+    ~EdgeStore() {
+        unmap();
+        dropPending();
+        delete pending;
+        delete positions;
+    }
+
+    EdgeStore(const EdgeStore&) = delete;
+    EdgeStore& operator=(const EdgeStore&) = delete;
+
+    // Maps the file if there is one. Throws if it is not an edge store.
+    void load() {
+        unmap();
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size < static_cast<off_t>(HEADER_SIZE)) {
+            ::close(fd);
+            return;
+        }
+
+        void* map = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            throw runtime_error("Failed to map " + path);
+        }
+
+        uint32_t magic;
+        uint32_t version;
+        uint64_t owners;
+        uint64_t edges;
+        uint64_t dataBytes;
+        const char* header = static_cast<const char*>(map);
+        memcpy(&magic, header, sizeof(uint32_t));
+        memcpy(&version, header + 4, sizeof(uint32_t));
+        memcpy(&owners, header + 8, sizeof(uint64_t));
+        memcpy(&edges, header + 16, sizeof(uint64_t));
+        memcpy(&dataBytes, header + 24, sizeof(uint64_t));
+
+        if (version == RAW_EDGES_VERSION) {
+            dataBytes = edges * sizeof(RatingEdge);
         }
+
+        uint64_t expected = HEADER_SIZE + (owners + 1) * sizeof(uint64_t) + dataBytes;
+        if (magic != EDGE_STORE_MAGIC || (version != EDGE_STORE_VERSION && version != RAW_EDGES_VERSION) ||
+            expected != static_cast<uint64_t>(size)) {
+            munmap(map, static_cast<size_t>(size));
+            throw runtime_error("Unsupported edge store format: " + path);
+        }
+
+        baseMap = static_cast<char*>(map);
+        baseBytes = static_cast<size_t>(size);
+        baseVersion = version;
+        ownerCount = owners;
+        offsets = reinterpret_cast<const uint64_t*>(baseMap + HEADER_SIZE);
+        baseData = baseMap + HEADER_SIZE + (owners + 1) * sizeof(uint64_t);
     }
 
-    void writeRatings(uint32_t userID, const vector<RatingEdge>& ratings) {
-        string filename = getEdgeFilename(userID);
+    bool isMapped() const {
+        return baseMap != nullptr;
+    }
 
-        fstream file(filename, ios::out | ios::binary | ios::trunc);
+    // One past the highest owner ID with edges in the base or pending.
+    uint64_t getOwnerLimit() const {
+        uint64_t limit = ownerCount;
+        pending->forEach([&limit](uint32_t owner, PendingList*) {
+            if (owner + 1ull > limit) {
+                limit = owner + 1ull;
+            }
+        });
+        return limit;
+    }
 
-        if (!file.is_open()) {
-            throw runtime_error("Failed to create edge file: " + filename);
+    // Replaces out with the owner's edges.
+    void edgesOf(uint32_t owner, vector<RatingEdge>& out) const {
+        PendingList* list;
+        if (pending->find(owner, list)) {
+            out.assign(list->edges.begin(), list->edges.end());
+            if (!list->sorted) {
+                sort(out.begin(), out.end(), byNeighbour);
+            }
+            return;
         }
+        baseEdges(owner, out);
+    }
 
-        uint32_t count = static_cast<uint32_t>(ratings.size());
-        file.write(reinterpret_cast<const char*>(&count), sizeof(uint32_t));
+    size_t countOf(uint32_t owner) const {
+        PendingList* list;
+        if (pending->find(owner, list)) {
+            return list->edges.size();
+        }
+        return baseCount(owner);
+    }
 
-        char buffer[RatingEdge::getSize()];
-        for (size_t i = 0; i < ratings.size(); i++) {
-            ratings[i].serialize(buffer);
-            file.write(buffer, RatingEdge::getSize());
+    bool findRating(uint32_t owner, uint32_t neighbour, uint32_t& ratingValue) const {
+        PendingList* list;
+        if (pending->find(owner, list)) {
+            uint32_t position;
+            if (!positions->find(edgeKey(owner, neighbour), position)) {
+                return false;
+            }
+            ratingValue = list->edges[position].ratingValue;
+            return true;
+        }
+
+        if (owner >= ownerCount) {
+            return false;
         }
-        file.close();
+        if (baseVersion == RAW_EDGES_VERSION) {
+            vector<RatingEdge> edges;
+            baseEdges(owner, edges);
+            vector<RatingEdge>::iterator it = lowerBound(edges, neighbour);
+            if (it == edges.end() || it->movieID != neighbour) {
+                return false;
+            }
+            ratingValue = it->ratingValue;
+            return true;
+        }
+        return EdgeCodec::findRating(baseData + offsets[owner],
+            static_cast<size_t>(offsets[owner + 1] - offsets[owner]), neighbour, ratingValue);
     }
 
-    vector<RatingEdge> readRatings(uint32_t userID) {
-        string filename = getEdgeFilename(userID);
-        fstream file(filename, ios::in | ios::binary);
+    // Replaces the owner's edge to edge.movieID, or appends it.
+    void set(uint32_t owner, const RatingEdge& edge) {
+        PendingList* list = pendingList(owner);
 
-        vector<RatingEdge> ratings;
+        uint32_t* position = positions->get(edgeKey(owner, edge.movieID));
+        if (position != nullptr) {
+            list->edges[*position] = edge;
+            return;
+        }
 
-        if (!file.is_open()) {
-            return ratings;
+        if (!list->edges.empty() && edge.movieID < list->edges.back().movieID) {
+            list->sorted = false;
         }
+        positions->insert(edgeKey(owner, edge.movieID), static_cast<uint32_t>(list->edges.size()));
+        list->edges.push_back(edge);
+    }
 
-        uint32_t count;
-        file.read(reinterpret_cast<char*>(&count), sizeof(uint32_t));
+    // Removes one edge by moving the owner's last edge into its place.
+    void remove(uint32_t owner, uint32_t neighbour) {
+        PendingList* list = pendingList(owner);
 
-        if (file.fail()) {
-            file.close();
-            return ratings;
+        uint32_t position;
+        if (!positions->find(edgeKey(owner, neighbour), position)) {
+            return;
         }
+        positions->remove(edgeKey(owner, neighbour));
 
-        ratings.reserve(count);
-        char buffer[RatingEdge::getSize()];
+        if (position + 1 != list->edges.size()) {
+            list->edges[position] = list->edges.back();
+            positions->insert(edgeKey(owner, list->edges.back().movieID), position);
+            list->sorted = false;
+        }
+        list->edges.pop_back();
+    }
 
-        for (uint32_t i = 0; i < count; i++) {
-            file.read(buffer, RatingEdge::getSize());
-            if (file.fail()) break;
+    void clear(uint32_t owner) {
+        PendingList* list = pendingList(owner);
+        for (const RatingEdge& edge : list->edges) {
+            positions->remove(edgeKey(owner, edge.movieID));
+        }
+        list->edges.clear();
+        list->sorted = true;
+    }
 
-            RatingEdge edge = RatingEdge::deserialize(buffer);
-            ratings.push_back(edge);
+    // Writes base plus pending lists for owners below ownerLimit to
+    // path.tmp and syncs it. install() then swaps it in. Blocks of
+    // untouched owners are copied over as they are.
+    void writeMerged(uint64_t ownerLimit) const {
+        string tempPath = path + ".tmp";
+        int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to create " + tempPath);
         }
 
-        file.close();
-        return ratings;
+        size_t dataStart = HEADER_SIZE + (ownerLimit + 1) * sizeof(uint64_t);
+        if (lseek(fd, static_cast<off_t>(dataStart), SEEK_SET) < 0) {
+            ::close(fd);
+            throw runtime_error("Failed to seek " + tempPath);
+        }
+
+        vector<uint64_t> newOffsets(ownerLimit + 1, 0);
+        uint64_t totalEdges = 0;
+        vector<RatingEdge> edges;
+        vector<char> buffer;
+
+        for (uint64_t owner = 0; owner < ownerLimit; owner++) {
+            uint32_t id = static_cast<uint32_t>(owner);
+            size_t before = buffer.size();
+
+            if (!pending->contains(id) && baseVersion != RAW_EDGES_VERSION && owner < ownerCount) {
+                buffer.insert(buffer.end(), baseData + offsets[owner], baseData + offsets[owner + 1]);
+                totalEdges = totalEdges + baseCount(id);
+            }
+            else {
+                edgesOf(id, edges);
+                EdgeCodec::encode(edges, buffer);
+                totalEdges = totalEdges + edges.size();
+            }
+
+            newOffsets[owner + 1] = newOffsets[owner] + (buffer.size() - before);
+            if (buffer.size() >= EDGE_WRITE_BUFFER_BYTES) {
+                writeAll(fd, buffer.data(), buffer.size(), tempPath);
+                buffer.clear();
+            }
+        }
+        writeAll(fd, buffer.data(), buffer.size(), tempPath);
+
+        char header[HEADER_SIZE];
+        uint32_t magic = EDGE_STORE_MAGIC;
+        uint32_t version = EDGE_STORE_VERSION;
+        memcpy(header, &magic, sizeof(uint32_t));
+        memcpy(header + 4, &version, sizeof(uint32_t));
+        memcpy(header + 8, &ownerLimit, sizeof(uint64_t));
+        memcpy(header + 16, &totalEdges, sizeof(uint64_t));
+        memcpy(header + 24, &newOffsets[ownerLimit], sizeof(uint64_t));
+
+        if (lseek(fd, 0, SEEK_SET) < 0) {
+            ::close(fd);
+            throw runtime_error("Failed to seek " + tempPath);
+        }
+        writeAll(fd, header, HEADER_SIZE, tempPath);
+        writeAll(fd, reinterpret_cast<const char*>(newOffsets.data()),
+            newOffsets.size() * sizeof(uint64_t), tempPath);
+
+        if (fdatasync(fd) != 0) {
+            ::close(fd);
+            throw runtime_error("Failed to sync " + tempPath);
+        }
+        ::close(fd);
     }
 
-    void addOrUpdateRating(uint32_t userID, uint32_t movieID, float ratingValue) {
-        vector<RatingEdge> ratings = readRatings(userID);
+    void install() {
+        unmap();
+        fs::rename(path + ".tmp", path);
+        dropPending();
+        load();
+    }
+};
 
-        bool found = false;
+// All ratings, kept in two EdgeStores: edges.csr keyed by user (the movies
+// a user rated) and raters.csr keyed by movie (the users who rated it).
+// Either side of a rating is one block read from a mapped file.
+//
+// Changes are appended to edges.log and applied to both stores' pending
+// lists. Once the log reaches EDGE_LOG_MERGE_BYTES, or on merge(), both
+// stores are rewritten and the log starts over. raters.csr is renamed into
+// place first, so after a crash it is never older than edges.csr, and
+// replaying the log over either generation gives the same result.
+class EdgeFileManager {
+private:
+    static const uint32_t SET_EDGE = 1;
+    static const uint32_t CLEAR_USER = 2;
 
-        for (size_t i = 0; i < ratings.size(); i++) {
-            RatingEdge& edge = ratings[i];
-            if (edge.movieID == movieID) {
-                edge.setRating(ratingValue);
-                found = true;
-                break;
+    struct LogRecord {
+        uint32_t type;
+        uint32_t userID;
+        RatingEdge edge;
+    };
+
+    fs::path baseDir;
+    string logPath;
+
+    int logFd;
+    uint64_t logBytes;
+
+    EdgeStore* byUser;
+    EdgeStore* byMovie;
+
+    mutable shared_mutex edgeLatch;
+
+    // Applies records in order, each in O(1) per edge touched.
+    void apply(const LogRecord* records, size_t count) {
+        vector<RatingEdge> edges;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t userID = records[i].userID;
+
+            if (records[i].type == CLEAR_USER) {
+                byUser->edgesOf(userID, edges);
+                for (const RatingEdge& edge : edges) {
+                    byMovie->remove(edge.movieID, userID);
+                }
+                byUser->clear(userID);
+                continue;
             }
+
+            RatingEdge rater = records[i].edge;
+            rater.movieID = userID;
+            byMovie->set(records[i].edge.movieID, rater);
+            byUser->set(userID, records[i].edge);
+        }
+    }
+
+    // Caller holds edgeLatch exclusively.
+    void record(const vector<LogRecord>& records) {
+        if (records.empty()) {
+            return;
         }
 
-        if (!found) {
-            ratings.push_back(RatingEdge(movieID, ratingValue));
+        const char* data = reinterpret_cast<const char*>(records.data());
+        size_t length = records.size() * sizeof(LogRecord);
+        while (length > 0) {
+            ssize_t written = ::write(logFd, data, length);
+            if (written <= 0) {
+                throw runtime_error("Failed to write " + logPath);
+            }
+            data = data + written;
+            length = length - static_cast<size_t>(written);
         }
+        logBytes = logBytes + records.size() * sizeof(LogRecord);
 
-        writeRatings(userID, ratings);
+        apply(records.data(), records.size());
+
+        if (logBytes >= EDGE_LOG_MERGE_BYTES) {
+            mergeLocked();
+        }
     }
 
-    bool getRating(uint32_t userID, uint32_t movieID, float& ratingValue) {
-        vector<RatingEdge> ratings = readRatings(userID);
+    // Applies every whole record in the log and drops a torn tail.
+    void replayLog() {
+        off_t size = lseek(logFd, 0, SEEK_END);
+        size_t whole = (size > 0 ? static_cast<size_t>(size) : 0) / sizeof(LogRecord);
 
-        for (size_t i = 0; i < ratings.size(); i++) {
-            const RatingEdge& edge = ratings[i];
-            if (edge.movieID == movieID) {
-                ratingValue = edge.getRating();
-                return true;
+        vector<LogRecord> records(whole);
+        if (whole > 0 && pread(logFd, records.data(), whole * sizeof(LogRecord), 0) !=
+            static_cast<ssize_t>(whole * sizeof(LogRecord))) {
+            throw runtime_error("Failed to read " + logPath);
+        }
+
+        apply(records.data(), records.size());
+
+        logBytes = whole * sizeof(LogRecord);
+        if (static_cast<off_t>(logBytes) != size && ftruncate(logFd, static_cast<off_t>(logBytes)) != 0) {
+            throw runtime_error("Failed to truncate " + logPath);
+        }
+    }
+
+    // Stores from before the CSR file kept one user_<id>.edges file per
+    // user. They are folded into a fresh store once and removed.
+    void importUserFiles() {
+        vector<fs::path> imported;
+        for (const auto& entry : fs::directory_iterator(baseDir)) {
+            string name = entry.path().filename().string();
+            if (name.size() <= 11 || name.compare(0, 5, "user_") != 0 ||
+                name.compare(name.size() - 6, 6, ".edges") != 0) {
+                continue;
+            }
+
+            uint32_t userID = static_cast<uint32_t>(stoul(name.substr(5, name.size() - 11)));
+            fstream file(entry.path(), ios::in | ios::binary);
+            uint32_t count = 0;
+            file.read(reinterpret_cast<char*>(&count), sizeof(uint32_t));
+
+            vector<LogRecord> records;
+            char buffer[RatingEdge::getSize()];
+            for (uint32_t i = 0; i < count && file.read(buffer, RatingEdge::getSize()); i++) {
+                LogRecord entryRecord;
+                entryRecord.type = SET_EDGE;
+                entryRecord.userID = userID;
+                entryRecord.edge = RatingEdge::deserialize(buffer);
+                records.push_back(entryRecord);
             }
+            apply(records.data(), records.size());
+            imported.push_back(entry.path());
+        }
+
+        if (imported.empty()) {
+            return;
         }
 
-        return false;
+        mergeLocked();
+        for (const fs::path& path : imported) {
+            fs::remove(path);
+        }
     }
 
-    bool hasRating(uint32_t userID, uint32_t movieID) {
-        vector<RatingEdge> ratings = readRatings(userID);
+    // Stores written before raters.csr existed have only edges.csr; the
+    // reverse side is rebuilt from it once.
+    void buildRaters() {
+        uint64_t users = byUser->getOwnerLimit();
+        vector<RatingEdge> edges;
+        for (uint64_t userID = 0; userID < users; userID++) {
+            byUser->edgesOf(static_cast<uint32_t>(userID), edges);
+            for (const RatingEdge& edge : edges) {
+                RatingEdge rater = edge;
+                rater.movieID = static_cast<uint32_t>(userID);
+                byMovie->set(edge.movieID, rater);
+            }
+        }
+        mergeLocked();
+    }
+
+    // Caller holds edgeLatch exclusively.
+    void mergeLocked() {
+        byMovie->writeMerged(byMovie->getOwnerLimit());
+        byUser->writeMerged(byUser->getOwnerLimit());
+        byMovie->install();
+        byUser->install();
+
+        if (ftruncate(logFd, 0) != 0) {
+            throw runtime_error("Failed to truncate " + logPath);
+        }
+        logBytes = 0;
+    }
+
+public:
+    EdgeFileManager(const string& dir = "ratings") : baseDir(dir), logBytes(0) {
+        if (!fs::exists(baseDir)) {
+            fs::create_directories(baseDir);
+        }
+
+        logPath = (baseDir / "edges.log").string();
+        byUser = new EdgeStore((baseDir / "edges.csr").string());
+        byMovie = new EdgeStore((baseDir / "raters.csr").string());
+
+        logFd = open(logPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (logFd < 0) {
+            throw runtime_error("Failed to open " + logPath);
+        }
+
+        replayLog();
+        if (byUser->isMapped() && !byMovie->isMapped()) {
+            buildRaters();
+        }
+        if (!byUser->isMapped() && logBytes == 0) {
+            importUserFiles();
+        }
+    }
+
+    ~EdgeFileManager() {
+        fdatasync(logFd);
+        ::close(logFd);
+        delete byUser;
+        delete byMovie;
+    }
+
+    EdgeFileManager(const EdgeFileManager&) = delete;
+    EdgeFileManager& operator=(const EdgeFileManager&) = delete;
 
+    void writeRatings(uint32_t userID, const vector<RatingEdge>& ratings) {
+        unique_lock<shared_mutex> lock(edgeLatch);
+
+        vector<LogRecord> records(ratings.size() + 1);
+        records[0].type = CLEAR_USER;
+        records[0].userID = userID;
         for (size_t i = 0; i < ratings.size(); i++) {
-            const RatingEdge& edge = ratings[i];
-            if (edge.movieID == movieID) {
-                return true;
+            records[i + 1].type = SET_EDGE;
+            records[i + 1].userID = userID;
+            records[i + 1].edge = ratings[i];
+        }
+        record(records);
+    }
+
+    // The user's ratings in movie ID order.
+    vector<RatingEdge> readRatings(uint32_t userID) {
+        shared_lock<shared_mutex> lock(edgeLatch);
+        vector<RatingEdge> ratings;
+        byUser->edgesOf(userID, ratings);
+        return ratings;
+    }
+
+    // Everyone who rated the movie, in user ID order. Here each edge's
+    // movieID field holds the rater's user ID.
+    vector<RatingEdge> readRaters(uint32_t movieID) {
+        shared_lock<shared_mutex> lock(edgeLatch);
+        vector<RatingEdge> raters;
+        byMovie->edgesOf(movieID, raters);
+        return raters;
+    }
+
+    // The movies both users rated, in movie ID order, as pairs of the two
+    // users' edges. One merge pass over the two sorted lists.
+    vector<pair<RatingEdge, RatingEdge>> commonRatings(uint32_t userA, uint32_t userB) {
+        vector<RatingEdge> ratingsA;
+        vector<RatingEdge> ratingsB;
+        {
+            shared_lock<shared_mutex> lock(edgeLatch);
+            byUser->edgesOf(userA, ratingsA);
+            byUser->edgesOf(userB, ratingsB);
+        }
+
+        vector<pair<RatingEdge, RatingEdge>> common;
+        size_t i = 0;
+        size_t j = 0;
+        while (i < ratingsA.size() && j < ratingsB.size()) {
+            if (ratingsA[i].movieID < ratingsB[j].movieID) {
+                i++;
+            }
+            else if (ratingsB[j].movieID < ratingsA[i].movieID) {
+                j++;
+            }
+            else {
+                common.push_back(make_pair(ratingsA[i], ratingsB[j]));
+                i++;
+                j++;
             }
         }
+        return common;
+    }
+
+    // Appends new ratings, replacing any earlier rating of the same movie.
+    // Returns the user's rating count afterwards.
+    size_t appendRatings(uint32_t userID, const vector<RatingEdge>& ratings) {
+        unique_lock<shared_mutex> lock(edgeLatch);
+
+        vector<LogRecord> records(ratings.size());
+        for (size_t i = 0; i < ratings.size(); i++) {
+            records[i].type = SET_EDGE;
+            records[i].userID = userID;
+            records[i].edge = ratings[i];
+        }
+        record(records);
+
+        return byUser->countOf(userID);
+    }
+
+    void addOrUpdateRating(uint32_t userID, uint32_t movieID, float ratingValue) {
+        float previous;
+        addOrUpdateRating(userID, movieID, ratingValue, previous);
+    }
+
+    // As above, and reports the rating it replaced. Returns false if the
+    // user had not rated the movie.
+    bool addOrUpdateRating(uint32_t userID, uint32_t movieID, float ratingValue, float& previous) {
+        unique_lock<shared_mutex> lock(edgeLatch);
+
+        uint32_t existing;
+        bool hadRating = byUser->findRating(userID, movieID, existing);
+        if (hadRating) {
+            previous = existing / 100.0f;
+        }
+
+        vector<LogRecord> records(1);
+        records[0].type = SET_EDGE;
+        records[0].userID = userID;
+        records[0].edge = RatingEdge(movieID, ratingValue);
+        record(records);
 
-        return false;
+        return hadRating;
+    }
+
+    bool getRating(uint32_t userID, uint32_t movieID, float& ratingValue) {
+        shared_lock<shared_mutex> lock(edgeLatch);
+
+        uint32_t stored;
+        if (!byUser->findRating(userID, movieID, stored)) {
+            return false;
+        }
+        ratingValue = stored / 100.0f;
+        return true;
+    }
+
+    bool hasRating(uint32_t userID, uint32_t movieID) {
+        float ratingValue;
+        return getRating(userID, movieID, ratingValue);
     }
 
     void deleteUserEdges(uint32_t userID) {
-        string filename = getEdgeFilename(userID);
-        remove(filename.c_str());
+        unique_lock<shared_mutex> lock(edgeLatch);
+
+        if (byUser->countOf(userID) == 0) {
+            return;
+        }
+
+        vector<LogRecord> records(1);
+        records[0].type = CLEAR_USER;
+        records[0].userID = userID;
+        record(records);
+    }
+
+    void sync() {
+        fdatasync(logFd);
+    }
+
+    void merge() {
+        unique_lock<shared_mutex> lock(edgeLatch);
+        if (logBytes > 0) {
+            mergeLocked();
+        }
     }
 };
 
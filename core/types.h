@@ -38,17 +38,50 @@ enum class ErrorCode {
     SYSTEM_UNKNOWN = 999
 };
 
+enum class WalDurability {
+    SYNC,
+    BATCHED,
+    ASYNC
+};
+
 const size_t BLOCK_SIZE = 4096;
-const size_t BTREE_DEGREE = 64;
+const size_t BTREE_CACHE_PAGES = 1024;
+const float BTREE_BULK_FILL_FACTOR = 1.0f;
+const bool BTREE_MEMORY_MAPPED = false;
+const uint64_t BTREE_MMAP_RESERVE = 1ull << 36;
+const size_t STORAGE_CACHE_BLOCKS = 256;
+const size_t STORAGE_READ_AHEAD_BLOCKS = 16;
 const size_t HASH_TABLE_SIZE = 1009;
+const float HASH_TABLE_LOAD_FACTOR = 0.8f;
+const size_t CONCURRENT_MAP_SHARDS = 16;
 const float MIN_RATING = 1.0f;
 const float MAX_RATING = 5.0f;
-const uint64_t METADATA_SIZE = 16;
+const uint64_t METADATA_SIZE = 64;
+const uint32_t BTREE_MAGIC = 0x49545042;
+const uint32_t BTREE_FORMAT_VERSION = 3;
+const uint32_t BTREE_LEGACY_DEGREE = 64;
+
+const char* const WAL_FILE = "graph.wal";
+const WalDurability WAL_DURABILITY = WalDurability::ASYNC;
+const uint32_t WAL_GROUP_COMMIT_USEC = 200;
+const uint32_t WAL_ASYNC_FLUSH_MS = 20;
+const size_t WAL_BUFFER_BYTES = 1 << 20;
+const uint64_t WAL_CHECKPOINT_BYTES = 64ull << 20;
+
+const uint32_t EDGE_STORE_MAGIC = 0x45444745;
+const uint32_t EDGE_STORE_VERSION = 2;
+const uint64_t EDGE_LOG_MERGE_BYTES = 16ull << 20;
+const size_t EDGE_WRITE_BUFFER_BYTES = 1 << 20;
+
+const char* const GENRE_DICT_FILE = "genres.dat";
+const uint32_t GENRE_DICT_MAGIC = 0x524e4547;
+const uint32_t GENRE_DICT_VERSION = 1;
 
 const size_t MAX_USERNAME_LENGTH = 64;
 const size_t MAX_TITLE_LENGTH = 128;
 const size_t MAX_GENRES = 5;
 const size_t MAX_GENRE_LENGTH = 32;
+const size_t MAX_GENRE_IDS = 64;
 
 const size_t USER_NODE_SIZE = 4 + MAX_USERNAME_LENGTH + 4 + 4 + 8;
 const size_t MOVIE_NODE_SIZE = 4 + MAX_TITLE_LENGTH + (MAX_GENRES * MAX_GENRE_LENGTH) + 4 + 4 + 4 + 8;
@@ -59,6 +92,7 @@ const size_t MOVIES_PER_BLOCK = BLOCK_SIZE / MOVIE_NODE_SIZE;
 static const uint32_t MAX_SLOTS = 1000000;
 
 const int BATCH_SIZE = 20000;
+const size_t MOVIE_BATCH_SIZE = 1024;
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,511 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hash_table.h"
+#include "types.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Redo log of page images shared by several data files. Each appended batch
+// is one checksummed record, so the pages of a split or merge are replayed
+// together or not at all. Commits are grouped: one thread writes and syncs
+// the log for every committer waiting behind it.
+//
+// SYNC      commit() returns once the record is on disk.
+// BATCHED   as SYNC, but the syncing thread waits briefly for other
+//           committers to join the group.
+// ASYNC     commit() returns at once; a background thread syncs the log.
+//
+// The log lives in numbered segments (<base>.<n>). A checkpoint starts a new
+// segment, flushes the data files and deletes the older segments.
+class WriteAheadLog {
+public:
+    class Batch {
+    private:
+        vector<char> payload;
+        uint32_t count;
+
+        friend class WriteAheadLog;
+
+    public:
+        Batch() : count(0) {}
+
+        void add(uint32_t target, uint64_t offset, const char* data, uint32_t length) {
+            size_t start = payload.size();
+            payload.resize(start + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t) + length);
+
+            char* out = payload.data() + start;
+            memcpy(out, &target, sizeof(uint32_t));
+            out = out + sizeof(uint32_t);
+            memcpy(out, &offset, sizeof(uint64_t));
+            out = out + sizeof(uint64_t);
+            memcpy(out, &length, sizeof(uint32_t));
+            out = out + sizeof(uint32_t);
+            memcpy(out, data, length);
+
+            count++;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+    };
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x524C4157;
+    static const uint32_t RECORD_TARGET = 1;
+    static const uint32_t RECORD_PAGES = 2;
+    static const uint32_t RECORD_RESET = 3;
+    static const size_t RECORD_HEADER_SIZE = 4 * sizeof(uint32_t);
+
+    string basePath;
+    WalDurability mode;
+    int fd;
+    uint64_t segment;
+    uint64_t segmentBytes;
+
+    vector<char> buffer;
+    uint64_t appendedLsn;
+    uint64_t durableLsn;
+    bool syncing;
+    uint32_t committers;
+
+    HashTable<string, uint32_t>* targetIDs;
+    vector<string> targetPaths;
+    vector<bool> targetLogged;
+    HashTable<string, bool>* recovered;
+
+    mutex logMutex;
+    mutex checkpointMutex;
+    condition_variable durableCond;
+    condition_variable flusherCond;
+    thread flusher;
+    bool stopping;
+
+    static uint32_t checksum(const char* data, size_t length) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < length; i++) {
+            hash = hash ^ static_cast<uint8_t>(data[i]);
+            hash = hash * 16777619u;
+        }
+        return hash;
+    }
+
+    string segmentPath(uint64_t n) const {
+        return basePath + "." + to_string(n);
+    }
+
+    vector<uint64_t> listSegments() const {
+        vector<uint64_t> segments;
+
+        fs::path base(basePath);
+        fs::path dir = base.parent_path().empty() ? fs::path(".") : base.parent_path();
+        string prefix = base.filename().string() + ".";
+
+        for (const auto& entry : fs::directory_iterator(dir)) {
+            string name = entry.path().filename().string();
+            if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+
+            string suffix = name.substr(prefix.size());
+            if (suffix.find_first_not_of("0123456789") != string::npos) {
+                continue;
+            }
+            segments.push_back(stoull(suffix));
+        }
+
+        sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Caller holds logMutex.
+    void appendRecord(uint32_t type, const char* payload, uint32_t length) {
+        uint32_t header[4] = { RECORD_MAGIC, type, length, checksum(payload, length) };
+
+        size_t start = buffer.size();
+        buffer.resize(start + RECORD_HEADER_SIZE + length);
+        memcpy(buffer.data() + start, header, RECORD_HEADER_SIZE);
+        memcpy(buffer.data() + start + RECORD_HEADER_SIZE, payload, length);
+    }
+
+    // Caller holds logMutex.
+    void logTarget(uint32_t target) {
+        if (targetLogged[target]) {
+            return;
+        }
+
+        const string& path = targetPaths[target];
+        vector<char> payload(sizeof(uint32_t) + path.size());
+        memcpy(payload.data(), &target, sizeof(uint32_t));
+        memcpy(payload.data() + sizeof(uint32_t), path.data(), path.size());
+
+        appendRecord(RECORD_TARGET, payload.data(), static_cast<uint32_t>(payload.size()));
+        targetLogged[target] = true;
+    }
+
+    void writeFully(const vector<char>& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n <= 0) {
+                throw runtime_error("Failed to write log: " + basePath);
+            }
+            written = written + static_cast<size_t>(n);
+        }
+        segmentBytes = segmentBytes + data.size();
+    }
+
+    void openSegment(uint64_t n) {
+        segment = n;
+        segmentBytes = 0;
+        fd = open(segmentPath(n).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open log: " + segmentPath(n));
+        }
+
+        for (size_t i = 0; i < targetLogged.size(); i++) {
+            targetLogged[i] = false;
+        }
+    }
+
+    // Applies complete records in log order and stops at the first torn or
+    // corrupt one. Page images of a target written before its last reset are
+    // skipped, since the file was rewritten as a whole after them.
+    void replay(const vector<uint64_t>& segments) {
+        vector<vector<char>> logs;
+        for (uint64_t n : segments) {
+            vector<char> data;
+            int in = open(segmentPath(n).c_str(), O_RDONLY);
+            if (in >= 0) {
+                char chunk[65536];
+                ssize_t got;
+                while ((got = read(in, chunk, sizeof(chunk))) > 0) {
+                    data.insert(data.end(), chunk, chunk + got);
+                }
+                ::close(in);
+            }
+            logs.push_back(data);
+        }
+
+        HashTable<string, uint64_t> lastReset(HASH_TABLE_SIZE);
+        HashTable<string, int> files(HASH_TABLE_SIZE);
+
+        for (int pass = 0; pass < 2; pass++) {
+            uint64_t position = 0;
+
+            for (const vector<char>& data : logs) {
+                HashTable<uint32_t, string> paths(HASH_TABLE_SIZE);
+                bool torn = false;
+                size_t at = 0;
+
+                while (at + RECORD_HEADER_SIZE <= data.size()) {
+                    uint32_t header[4];
+                    memcpy(header, data.data() + at, RECORD_HEADER_SIZE);
+                    const char* payload = data.data() + at + RECORD_HEADER_SIZE;
+
+                    if (header[0] != RECORD_MAGIC || at + RECORD_HEADER_SIZE + header[2] > data.size() ||
+                        checksum(payload, header[2]) != header[3]) {
+                        torn = true;
+                        break;
+                    }
+                    at = at + RECORD_HEADER_SIZE + header[2];
+                    position++;
+
+                    if (header[1] == RECORD_TARGET) {
+                        uint32_t id;
+                        memcpy(&id, payload, sizeof(uint32_t));
+                        paths.insert(id, string(payload + sizeof(uint32_t), header[2] - sizeof(uint32_t)));
+                    }
+                    else if (header[1] == RECORD_RESET && pass == 0) {
+                        lastReset.insert(string(payload, header[2]), position);
+                    }
+                    else if (header[1] == RECORD_PAGES && pass == 1) {
+                        applyPages(payload, paths, lastReset, files, position);
+                    }
+                }
+
+                if (torn) {
+                    break;
+                }
+            }
+        }
+
+        files.forEach([](const string&, int fd) {
+            fsync(fd);
+            ::close(fd);
+        });
+    }
+
+    void applyPages(const char* payload, HashTable<uint32_t, string>& paths,
+        HashTable<string, uint64_t>& lastReset, HashTable<string, int>& files, uint64_t position) {
+        uint32_t pageCount;
+        memcpy(&pageCount, payload, sizeof(uint32_t));
+        const char* in = payload + sizeof(uint32_t);
+
+        for (uint32_t i = 0; i < pageCount; i++) {
+            uint32_t target;
+            uint64_t offset;
+            uint32_t length;
+            memcpy(&target, in, sizeof(uint32_t));
+            in = in + sizeof(uint32_t);
+            memcpy(&offset, in, sizeof(uint64_t));
+            in = in + sizeof(uint64_t);
+            memcpy(&length, in, sizeof(uint32_t));
+            in = in + sizeof(uint32_t);
+            const char* page = in;
+            in = in + length;
+
+            string path;
+            if (!paths.find(target, path)) {
+                continue;
+            }
+
+            uint64_t resetAt;
+            if (lastReset.find(path, resetAt) && position < resetAt) {
+                continue;
+            }
+
+            int file;
+            if (!files.find(path, file)) {
+                file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+                if (file < 0) {
+                    throw runtime_error("Failed to open " + path + " for log replay");
+                }
+                files.insert(path, file);
+                recovered->insert(path, true);
+            }
+
+            if (pwrite(file, page, length, static_cast<off_t>(offset)) != static_cast<ssize_t>(length)) {
+                throw runtime_error("Failed to replay log into " + path);
+            }
+        }
+    }
+
+    // Leader/follower group commit: the first waiter writes and syncs
+    // everything buffered so far, the rest wait for it.
+    void syncTo(unique_lock<mutex>& lock, uint64_t lsn) {
+        while (durableLsn < lsn) {
+            if (syncing) {
+                durableCond.wait(lock);
+                continue;
+            }
+            syncing = true;
+
+            if (mode == WalDurability::BATCHED && committers > 1) {
+                lock.unlock();
+                this_thread::sleep_for(chrono::microseconds(WAL_GROUP_COMMIT_USEC));
+                lock.lock();
+            }
+
+            vector<char> pending;
+            pending.swap(buffer);
+            uint64_t target = appendedLsn;
+            lock.unlock();
+
+            try {
+                writeFully(pending);
+                fdatasync(fd);
+            }
+            catch (...) {
+                lock.lock();
+                syncing = false;
+                durableCond.notify_all();
+                throw;
+            }
+
+            lock.lock();
+            durableLsn = target;
+            syncing = false;
+            durableCond.notify_all();
+        }
+    }
+
+    void runFlusher() {
+        unique_lock<mutex> lock(logMutex);
+        while (!stopping) {
+            flusherCond.wait_for(lock, chrono::milliseconds(WAL_ASYNC_FLUSH_MS));
+            syncTo(lock, appendedLsn);
+        }
+    }
+
+public:
+    WriteAheadLog(const string& path, WalDurability durability = WAL_DURABILITY)
+        : basePath(path), mode(durability), fd(-1), segment(0), segmentBytes(0),
+        appendedLsn(0), durableLsn(0), syncing(false), committers(0), stopping(false) {
+        targetIDs = new HashTable<string, uint32_t>(HASH_TABLE_SIZE);
+        recovered = new HashTable<string, bool>(HASH_TABLE_SIZE);
+
+        vector<uint64_t> segments = listSegments();
+        replay(segments);
+        for (uint64_t n : segments) {
+            unlink(segmentPath(n).c_str());
+        }
+
+        openSegment(segments.empty() ? 0 : segments.back() + 1);
+
+        if (mode == WalDurability::ASYNC) {
+            flusher = thread(&WriteAheadLog::runFlusher, this);
+        }
+    }
+
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> lock(logMutex);
+            stopping = true;
+        }
+        flusherCond.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+
+        try {
+            sync();
+        }
+        catch (...) {}
+
+        ::close(fd);
+        delete targetIDs;
+        delete recovered;
+    }
+
+    uint32_t registerTarget(const string& path) {
+        lock_guard<mutex> lock(logMutex);
+
+        uint32_t id;
+        if (!targetIDs->find(path, id)) {
+            id = static_cast<uint32_t>(targetPaths.size());
+            targetIDs->insert(path, id);
+            targetPaths.push_back(path);
+            targetLogged.push_back(false);
+        }
+        return id;
+    }
+
+    // True if startup replay wrote into the file at path.
+    bool wasRecovered(const string& path) const {
+        return recovered->contains(path);
+    }
+
+    uint64_t append(const Batch& batch) {
+        if (batch.empty()) {
+            return 0;
+        }
+
+        lock_guard<mutex> lock(logMutex);
+
+        const char* in = batch.payload.data();
+        for (uint32_t i = 0; i < batch.count; i++) {
+            uint32_t target;
+            uint32_t length;
+            memcpy(&target, in, sizeof(uint32_t));
+            memcpy(&length, in + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint32_t));
+            logTarget(target);
+            in = in + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t) + length;
+        }
+
+        vector<char> payload(sizeof(uint32_t));
+        memcpy(payload.data(), &batch.count, sizeof(uint32_t));
+        payload.insert(payload.end(), batch.payload.begin(), batch.payload.end());
+        appendRecord(RECORD_PAGES, payload.data(), static_cast<uint32_t>(payload.size()));
+
+        appendedLsn++;
+        if (buffer.size() >= WAL_BUFFER_BYTES) {
+            flusherCond.notify_one();
+        }
+        return appendedLsn;
+    }
+
+    // Records that the file at path was rewritten and synced as a whole, so
+    // earlier page images for it must not be replayed. Durable on return.
+    void reset(uint32_t target) {
+        unique_lock<mutex> lock(logMutex);
+
+        const string& path = targetPaths[target];
+        appendRecord(RECORD_RESET, path.data(), static_cast<uint32_t>(path.size()));
+        appendedLsn++;
+        syncTo(lock, appendedLsn);
+    }
+
+    // Waits until everything appended so far is durable, as the durability
+    // mode requires.
+    void commit() {
+        unique_lock<mutex> lock(logMutex);
+        if (mode == WalDurability::ASYNC) {
+            return;
+        }
+
+        committers++;
+        try {
+            syncTo(lock, appendedLsn);
+        }
+        catch (...) {
+            committers--;
+            throw;
+        }
+        committers--;
+    }
+
+    // Makes everything appended so far durable regardless of mode. Data
+    // pages are only written back after the log records describing them.
+    void sync() {
+        unique_lock<mutex> lock(logMutex);
+        syncTo(lock, appendedLsn);
+    }
+
+    bool needsCheckpoint() {
+        lock_guard<mutex> lock(logMutex);
+        return segmentBytes + buffer.size() >= WAL_CHECKPOINT_BYTES;
+    }
+
+    // Starts a new segment, runs flushData (which must write back and sync
+    // every data file that logs here) and drops the older segments. Records
+    // appended before the switch describe pages already in the data caches,
+    // so flushData persists them.
+    void checkpoint(const function<void()>& flushData) {
+        lock_guard<mutex> checkpointLock(checkpointMutex);
+
+        uint64_t oldSegment;
+        {
+            unique_lock<mutex> lock(logMutex);
+            syncTo(lock, appendedLsn);
+            while (syncing) {
+                durableCond.wait(lock);
+            }
+
+            writeFully(buffer);
+            buffer.clear();
+            fdatasync(fd);
+            durableLsn = appendedLsn;
+
+            ::close(fd);
+            oldSegment = segment;
+            openSegment(segment + 1);
+        }
+
+        flushData();
+
+        for (uint64_t n : listSegments()) {
+            if (n <= oldSegment) {
+                unlink(segmentPath(n).c_str());
+            }
+        }
+    }
+};
+
+#endif
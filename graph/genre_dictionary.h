@@ -0,0 +1,180 @@
+#ifndef GENRE_DICTIONARY_H
+#define GENRE_DICTIONARY_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../core/hash_table.h"
+#include "../core/types.h"
+#include "node.h"
+
+using namespace std;
+
+// Persistent mapping from genre names to small IDs, assigned in order of
+// first appearance. A movie's genres are stored as a bitmask of these IDs
+// (Movie::genreMask), so there are at most MAX_GENRE_IDS of them.
+//
+// The file is a header followed by one entry per ID: a length byte and the
+// name. New entries are appended and synced before their ID is handed
+// out, so no record on disk can refer to an ID the file does not have. A
+// torn last entry is dropped at open.
+class GenreDictionary {
+private:
+    static const size_t HEADER_SIZE = 8;
+
+    string path;
+    int fd;
+
+    vector<string> names;
+    HashTable<string, uint32_t>* ids;
+
+    mutable shared_mutex latch;
+
+    void load() {
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size == 0) {
+            char header[HEADER_SIZE];
+            uint32_t magic = GENRE_DICT_MAGIC;
+            uint32_t version = GENRE_DICT_VERSION;
+            memcpy(header, &magic, sizeof(uint32_t));
+            memcpy(header + 4, &version, sizeof(uint32_t));
+            if (pwrite(fd, header, HEADER_SIZE, 0) != static_cast<ssize_t>(HEADER_SIZE) || fdatasync(fd) != 0) {
+                throw runtime_error("Failed to write " + path);
+            }
+            return;
+        }
+
+        vector<char> data(static_cast<size_t>(size));
+        if (pread(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) {
+            throw runtime_error("Failed to read " + path);
+        }
+
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        if (data.size() >= HEADER_SIZE) {
+            memcpy(&magic, data.data(), sizeof(uint32_t));
+            memcpy(&version, data.data() + 4, sizeof(uint32_t));
+        }
+        if (magic != GENRE_DICT_MAGIC || version != GENRE_DICT_VERSION) {
+            throw runtime_error("Unsupported genre dictionary format: " + path);
+        }
+
+        size_t offset = HEADER_SIZE;
+        while (offset < data.size()) {
+            size_t length = static_cast<unsigned char>(data[offset]);
+            if (offset + 1 + length > data.size() || names.size() >= MAX_GENRE_IDS) {
+                break;
+            }
+            names.push_back(string(data.data() + offset + 1, length));
+            ids->insert(names.back(), static_cast<uint32_t>(names.size() - 1));
+            offset = offset + 1 + length;
+        }
+
+        if (offset != data.size() && ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+            throw runtime_error("Failed to truncate " + path);
+        }
+    }
+
+    // Caller holds latch exclusively.
+    uint32_t add(string_view name) {
+        if (names.size() >= MAX_GENRE_IDS) {
+            throw runtime_error("Too many distinct genres");
+        }
+
+        char entry[MAX_GENRE_LENGTH + 1];
+        entry[0] = static_cast<char>(name.size());
+        memcpy(entry + 1, name.data(), name.size());
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (pwrite(fd, entry, name.size() + 1, end) != static_cast<ssize_t>(name.size() + 1) ||
+            fdatasync(fd) != 0) {
+            throw runtime_error("Failed to write " + path);
+        }
+
+        names.push_back(string(name));
+        ids->insert(names.back(), static_cast<uint32_t>(names.size() - 1));
+        return static_cast<uint32_t>(names.size() - 1);
+    }
+
+public:
+    static constexpr uint32_t NO_GENRE = UINT32_MAX;
+
+    GenreDictionary(const string& file) : path(file) {
+        ids = new HashTable<string, uint32_t>(MAX_GENRE_IDS);
+
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open " + path);
+        }
+        load();
+    }
+
+    ~GenreDictionary() {
+        ::close(fd);
+        delete ids;
+    }
+
+    GenreDictionary(const GenreDictionary&) = delete;
+    GenreDictionary& operator=(const GenreDictionary&) = delete;
+
+    // The genre's ID, or NO_GENRE if it has none.
+    uint32_t find(string_view name) const {
+        shared_lock<shared_mutex> lock(latch);
+
+        uint32_t id;
+        if (!ids->find(name, id)) {
+            return NO_GENRE;
+        }
+        return id;
+    }
+
+    // The genre's ID, assigning and persisting a new one if needed.
+    uint32_t intern(string_view name) {
+        if (name.size() >= MAX_GENRE_LENGTH) {
+            name = name.substr(0, MAX_GENRE_LENGTH - 1);
+        }
+
+        uint32_t id = find(name);
+        if (id != NO_GENRE) {
+            return id;
+        }
+
+        unique_lock<shared_mutex> lock(latch);
+        if (ids->find(name, id)) {
+            return id;
+        }
+        return add(name);
+    }
+
+    // Bitmask of the movie's genres, interning any new ones.
+    uint64_t internAll(const Movie& movie) {
+        uint64_t mask = 0;
+        for (uint32_t i = 0; i < movie.getGenreCount(); i++) {
+            mask = mask | (1ull << intern(movie.getGenre(i)));
+        }
+        return mask;
+    }
+
+    string getName(uint32_t id) const {
+        shared_lock<shared_mutex> lock(latch);
+        return names[id];
+    }
+
+    // Names by ID; a genre's ID is its index here.
+    vector<string> getNames() const {
+        shared_lock<shared_mutex> lock(latch);
+        return names;
+    }
+
+    size_t getSize() const {
+        shared_lock<shared_mutex> lock(latch);
+        return names.size();
+    }
+};
+
+#endif
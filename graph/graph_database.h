@@ -3,8 +3,11 @@
 
 #include "../core/btree.h"
 #include "../core/storage_manager.h"
-#include "../core/hash_table.h"
+#include "../core/concurrent_hash_map.h"
+#include "../core/wal.h"
 #include "node.h"
+#include "genre_dictionary.h"
+#include "movie_catalog.h"
 #include <vector>
 #include <algorithm>
 #include <set>
@@ -15,14 +18,23 @@ using namespace std;
 
 class GraphDatabase {
 private:
-    BTree<uint32_t, uint64_t>* userIndex;
-    BTree<uint32_t, uint64_t>* movieIndex;
+    WriteAheadLog* wal;
+
+    // ID -> storage slot.
+    BTree<uint32_t, uint32_t>* userIndex;
+    BTree<uint32_t, uint32_t>* movieIndex;
 
     FixedStorage<User>* userStorage;
     FixedStorage<Movie>* movieStorage;
 
-    HashTable<string, vector<uint32_t>*>* genreIndex;
-    HashTable<string, uint32_t>* titleIndex;
+    GenreDictionary* genres;
+
+    // Shared with server threads that read them without the storage lock.
+    // genreIndex is keyed by genre ID.
+    ConcurrentHashMap<uint32_t, vector<uint32_t>>* genreIndex;
+    ConcurrentHashMap<string, uint32_t>* titleIndex;
+
+    MovieCatalog* catalog;
 
     string normalizeTitle(const string& title) const {
         string normalized;
@@ -35,39 +47,85 @@ private:
         return normalized;
     }
 
-    void indexMovieGenres(uint32_t movieID, const vector<string>& genres) {
-        for (const string& genre : genres) {
-            vector<uint32_t>* movieList;
-            if (!genreIndex->find(genre, movieList)) {
-                movieList = new vector<uint32_t>();
-                movieList->reserve(100);
-                genreIndex->insert(genre, movieList);
-            }
-
-            if (find(movieList->begin(), movieList->end(), movieID) == movieList->end()) {
-                if (movieList->size() < MAX_MOVIES_PER_GENRE) {
-                    movieList->push_back(movieID);
+    void indexMovieGenres(uint32_t movieID, uint64_t genreMask) {
+        for (uint64_t mask = genreMask; mask != 0; mask = mask & (mask - 1)) {
+            uint32_t genre = static_cast<uint32_t>(__builtin_ctzll(mask));
+            genreIndex->update(genre, [movieID](vector<uint32_t>& movieList) {
+                if (find(movieList.begin(), movieList.end(), movieID) == movieList.end()) {
+                    if (movieList.size() < MAX_MOVIES_PER_GENRE) {
+                        movieList.push_back(movieID);
+                    }
                 }
-            }
+            });
         }
     }
 
-    void removeMovieFromGenreIndex(uint32_t movieID, const vector<string>& genres) {
-        for (const string& genre : genres) {
-            vector<uint32_t>* movieList;
-            if (genreIndex->find(genre, movieList)) {
-                movieList->erase(
-                    remove(movieList->begin(), movieList->end(), movieID),
-                    movieList->end()
+    void removeMovieFromGenreIndex(uint32_t movieID, uint64_t genreMask) {
+        for (uint64_t mask = genreMask; mask != 0; mask = mask & (mask - 1)) {
+            uint32_t genre = static_cast<uint32_t>(__builtin_ctzll(mask));
+            genreIndex->modify(genre, [movieID](vector<uint32_t>& movieList) {
+                movieList.erase(
+                    remove(movieList.begin(), movieList.end(), movieID),
+                    movieList.end()
                 );
+            });
+        }
+    }
+
+    // The record's genre bitmask. Records written before the genre
+    // dictionary have none stored, so theirs is built from the names.
+    uint64_t genreMaskOf(const Movie& movie) {
+        if (movie.genreMask != 0) {
+            return movie.genreMask;
+        }
+        return genres->internAll(movie);
+    }
+
+    void commit() {
+        wal->commit();
+        if (wal->needsCheckpoint()) {
+            flush();
+        }
+    }
+
+    void loadIndex(BTree<uint32_t, uint32_t>* index, const vector<pair<uint32_t, uint32_t>>& sortedSlots) {
+        if (index->isEmpty()) {
+            BTree<uint32_t, uint32_t>::BulkLoader loader = index->bulkLoader(BTREE_BULK_FILL_FACTOR);
+            for (const auto& entry : sortedSlots) {
+                loader.add(entry.first, entry.second);
             }
+            loader.finish();
+            return;
+        }
+
+        for (const auto& entry : sortedSlots) {
+            index->insert(entry.first, entry.second);
+        }
+    }
+
+    // The slot already holding id's record, or a newly allocated one.
+    template<typename NodeType>
+    uint32_t slotFor(BTree<uint32_t, uint32_t>* index, FixedStorage<NodeType>* storage, uint32_t id) {
+        uint32_t slot;
+        if (index->search(id, slot)) {
+            return slot;
+        }
+        return storage->allocateSlot();
+    }
+
+    template<typename NodeType>
+    void claimSlots(BTree<uint32_t, uint32_t>* index, FixedStorage<NodeType>* storage) {
+        for (auto it = index->begin(); it != index->end(); ++it) {
+            storage->claimSlot(it.value());
         }
     }
 
 public:
     GraphDatabase() {
-        userIndex = new BTree<uint32_t, uint64_t>("user_index.dat");
-        movieIndex = new BTree<uint32_t, uint64_t>("movie_index.dat");
+        wal = new WriteAheadLog(WAL_FILE);
+
+        userIndex = new BTree<uint32_t, uint32_t>("user_index.dat");
+        movieIndex = new BTree<uint32_t, uint32_t>("movie_index.dat");
 
         userStorage = new FixedStorage<User>(
             "users.dat",
@@ -80,38 +138,45 @@ public:
             MOVIES_PER_BLOCK
         );
 
-        genreIndex = new HashTable<string, vector<uint32_t>*>(211);
-        titleIndex = new HashTable<string, uint32_t>(10007);
+        userIndex->attachLog(wal);
+        movieIndex->attachLog(wal);
+        userStorage->attachLog(wal);
+        movieStorage->attachLog(wal);
 
+        genres = new GenreDictionary(GENRE_DICT_FILE);
+        genreIndex = new ConcurrentHashMap<uint32_t, vector<uint32_t>>(MAX_GENRE_IDS);
+        titleIndex = new ConcurrentHashMap<string, uint32_t>(10007);
+        catalog = new MovieCatalog(genres);
+
+        claimSlots(userIndex, userStorage);
         rebuildIndices();
     }
 
     ~GraphDatabase() {
+        flush();
+
         delete userIndex;
         delete movieIndex;
         delete userStorage;
         delete movieStorage;
-
-        vector<string> genres = getAllGenresFromIndex();
-        for (const string& genre : genres) {
-            vector<uint32_t>* list;
-            if (genreIndex->find(genre, list)) {
-                delete list;
-            }
-        }
+        delete wal;
         delete genreIndex;
         delete titleIndex;
+        delete catalog;
+        delete genres;
     }
 
     void rebuildIndices() {
-        vector<pair<uint32_t, uint64_t>> allMovies = movieIndex->getAllPairs();
-
-        for (const auto& pair : allMovies) {
+        // Movies loaded in bulk sit in ascending slots, so the scan is
+        // mostly sequential.
+        movieStorage->setReadAhead(STORAGE_READ_AHEAD_BLOCKS);
+        for (auto it = movieIndex->begin(); it != movieIndex->end(); ++it) {
+            movieStorage->claimSlot(it.value());
             try {
-                Movie movie = movieStorage->readNode(pair.first);
-
-                vector<string> genres = movie.getGenres();
-                indexMovieGenres(movie.movieID, genres);
+                Movie movie = movieStorage->readNode(it.value());
+                movie.genreMask = genreMaskOf(movie);
+                catalog->put(it.value(), movie);
+                indexMovieGenres(movie.movieID, movie.genreMask);
 
                 string normTitle = normalizeTitle(movie.getTitle());
                 titleIndex->insert(normTitle, movie.movieID);
@@ -120,14 +185,21 @@ public:
                 continue;
             }
         }
+        movieStorage->setReadAhead(0);
     }
 
     vector<uint32_t> getMoviesByGenre(const string& genre) {
-        vector<uint32_t>* movieList;
-        if (genreIndex->find(genre, movieList)) {
-            return *movieList;
+        uint32_t genreID = genres->find(genre);
+        if (genreID == GenreDictionary::NO_GENRE) {
+            return vector<uint32_t>();
         }
-        return vector<uint32_t>();
+        return getMoviesByGenre(genreID);
+    }
+
+    vector<uint32_t> getMoviesByGenre(uint32_t genreID) {
+        vector<uint32_t> movieList;
+        genreIndex->find(genreID, movieList);
+        return movieList;
     }
 
     vector<uint32_t> searchMoviesByTitle(const string& query) {
@@ -138,57 +210,93 @@ public:
             return results;
         }
 
-        vector<pair<string, uint32_t>> allTitles = titleIndex->getAllPairs();
-
-        for (const auto& pair : allTitles) {
-            if (pair.first.find(normQuery) != string::npos) {
-                results.push_back(pair.second);
+        titleIndex->forEach([&](const string& title, uint32_t movieID) {
+            if (title.find(normQuery) != string::npos) {
+                results.push_back(movieID);
             }
-        }
+        });
 
         return results;
     }
 
     vector<string> getAllGenresFromIndex() {
-        return genreIndex->getAllKeys();
+        vector<string> names;
+        for (uint32_t genreID : genreIndex->getAllKeys()) {
+            names.push_back(genres->getName(genreID));
+        }
+        return names;
     }
 
     void addUser(uint32_t userID, const string& username) {
         User user(userID, username);
-        userStorage->writeNode(userID, user);
-        userIndex->insert(userID, userID);
+        uint32_t slot = slotFor(userIndex, userStorage, userID);
+        userStorage->writeNode(slot, user);
+        userIndex->insert(userID, slot);
+        commit();
+    }
+
+    void addUsers(const vector<pair<uint32_t, string>>& users) {
+        vector<pair<uint32_t, string>> sorted(users);
+        stable_sort(sorted.begin(), sorted.end(),
+            [](const pair<uint32_t, string>& a, const pair<uint32_t, string>& b) {
+                return a.first < b.first;
+            });
+
+        vector<pair<uint32_t, uint32_t>> slots;
+        slots.reserve(sorted.size());
+
+        for (size_t i = 0; i < sorted.size(); i++) {
+            if (i + 1 < sorted.size() && sorted[i + 1].first == sorted[i].first) {
+                continue;
+            }
+
+            uint32_t userID = sorted[i].first;
+            User user(userID, sorted[i].second);
+            uint32_t slot = slotFor(userIndex, userStorage, userID);
+            userStorage->writeNode(slot, user);
+            slots.push_back(make_pair(userID, slot));
+        }
+
+        loadIndex(userIndex, slots);
+        commit();
     }
 
     User getUser(uint32_t userID) {
-        uint64_t offset;
-        if (!userIndex->search(userID, offset)) {
+        uint32_t slot;
+        if (!userIndex->search(userID, slot)) {
             throw runtime_error("User not found");
         }
-        return userStorage->readNode(userID);
+        return userStorage->readNode(slot);
     }
 
     void updateUser(uint32_t userID, const User& user) {
-        uint64_t offset;
-        if (!userIndex->search(userID, offset)) {
+        uint32_t slot;
+        if (!userIndex->search(userID, slot)) {
             throw runtime_error("User not found");
         }
-        userStorage->writeNode(userID, user);
+        userStorage->writeNode(slot, user);
+        commit();
     }
 
     bool userExists(uint32_t userID) {
-        uint64_t offset;
-        return userIndex->search(userID, offset);
+        return userIndex->contains(userID);
     }
 
+    // The slot is reused only after the index entry is gone from the log.
     void deleteUser(uint32_t userID) {
+        uint32_t slot;
+        if (!userIndex->search(userID, slot)) {
+            return;
+        }
         userIndex->remove(userID);
+        commit();
+        userStorage->freeSlot(slot);
     }
 
     vector<uint32_t> getAllUserIDs() {
         vector<uint32_t> ids;
-        vector<pair<uint32_t, uint64_t>> pairs = userIndex->getAllPairs();
-        for (const auto& p : pairs) {
-            ids.push_back(p.first);
+        for (auto it = userIndex->begin(); it != userIndex->end(); ++it) {
+            ids.push_back(it.key());
         }
         return ids;
     }
@@ -197,78 +305,190 @@ public:
         return userIndex->size();
     }
 
-    void addMovie(uint32_t movieID, const string& title, const vector<string>& genres) {
-        Movie movie(movieID, title, genres);
-        movieStorage->writeNode(movieID, movie);
-        movieIndex->insert(movieID, movieID);
+    void addMovie(uint32_t movieID, const string& title, const vector<string>& genreNames) {
+        Movie movie(movieID, title, genreNames);
+        movie.genreMask = genres->internAll(movie);
+        uint32_t slot = slotFor(movieIndex, movieStorage, movieID);
+        movieStorage->writeNode(slot, movie);
+        movieIndex->insert(movieID, slot);
+        commit();
+        catalog->put(slot, movie);
 
-        indexMovieGenres(movieID, genres);
+        indexMovieGenres(movieID, movie.genreMask);
         string normTitle = normalizeTitle(title);
         titleIndex->insert(normTitle, movieID);
     }
 
+    // Writes a batch of movies and, when the index is still empty, builds it
+    // with a single bulk load instead of one insert per movie.
+    void addMovies(const vector<Movie>& movies) {
+        vector<Movie> sorted(movies);
+        stable_sort(sorted.begin(), sorted.end(),
+            [](const Movie& a, const Movie& b) {
+                return a.movieID < b.movieID;
+            });
+
+        vector<pair<uint32_t, uint32_t>> slots;
+        slots.reserve(sorted.size());
+
+        for (size_t i = 0; i < sorted.size(); i++) {
+            if (i + 1 < sorted.size() && sorted[i + 1].movieID == sorted[i].movieID) {
+                continue;
+            }
+
+            Movie& movie = sorted[i];
+            movie.genreMask = genres->internAll(movie);
+            uint32_t slot = slotFor(movieIndex, movieStorage, movie.movieID);
+            movieStorage->writeNode(slot, movie);
+            slots.push_back(make_pair(movie.movieID, slot));
+            catalog->put(slot, movie);
+
+            indexMovieGenres(movie.movieID, movie.genreMask);
+            titleIndex->insert(normalizeTitle(movie.getTitle()), movie.movieID);
+        }
+
+        loadIndex(movieIndex, slots);
+        commit();
+    }
+
     Movie getMovie(uint32_t movieID) {
-        uint64_t offset;
-        if (!movieIndex->search(movieID, offset)) {
+        uint32_t slot;
+        if (!movieIndex->search(movieID, slot)) {
             throw runtime_error("Movie not found");
         }
-        return movieStorage->readNode(movieID);
+        return movieStorage->readNode(slot);
+    }
+
+    // Movies in the order of movieIDs, read with one batched storage call.
+    // IDs that are not in the index come back as a Movie with movieID 0.
+    vector<Movie> getMovies(const vector<uint32_t>& movieIDs) {
+        vector<uint32_t> slots;
+        vector<size_t> positions;
+        for (size_t i = 0; i < movieIDs.size(); i++) {
+            uint32_t slot;
+            if (movieIndex->search(movieIDs[i], slot)) {
+                slots.push_back(slot);
+                positions.push_back(i);
+            }
+        }
+
+        vector<Movie> movies(movieIDs.size());
+        vector<Movie> found = movieStorage->readNodes(slots);
+        for (size_t i = 0; i < found.size(); i++) {
+            movies[positions[i]] = found[i];
+        }
+        return movies;
     }
 
     void updateMovie(uint32_t movieID, const Movie& movie) {
-        uint64_t offset;
-        if (!movieIndex->search(movieID, offset)) {
+        uint32_t slot;
+        if (!movieIndex->search(movieID, slot)) {
             throw runtime_error("Movie not found");
         }
 
         try {
-            Movie oldMovie = movieStorage->readNode(movieID);
-            removeMovieFromGenreIndex(movieID, oldMovie.getGenres());
+            Movie oldMovie = movieStorage->readNode(slot);
+            removeMovieFromGenreIndex(movieID, genreMaskOf(oldMovie));
             string oldTitle = normalizeTitle(oldMovie.getTitle());
             titleIndex->remove(oldTitle);
         }
         catch (...) {}
 
-        movieStorage->writeNode(movieID, movie);
+        Movie stored = movie;
+        stored.genreMask = genres->internAll(stored);
+        movieStorage->writeNode(slot, stored);
+        commit();
+        catalog->put(slot, stored);
 
-        indexMovieGenres(movieID, movie.getGenres());
+        indexMovieGenres(movieID, stored.genreMask);
         string normTitle = normalizeTitle(movie.getTitle());
         titleIndex->insert(normTitle, movieID);
     }
 
     bool movieExists(uint32_t movieID) {
-        uint64_t offset;
-        return movieIndex->search(movieID, offset);
+        return movieIndex->contains(movieID);
     }
 
     void deleteMovie(uint32_t movieID) {
+        uint32_t slot;
+        if (!movieIndex->search(movieID, slot)) {
+            return;
+        }
+
         try {
-            Movie movie = movieStorage->readNode(movieID);
-            removeMovieFromGenreIndex(movieID, movie.getGenres());
+            Movie movie = movieStorage->readNode(slot);
+            removeMovieFromGenreIndex(movieID, genreMaskOf(movie));
             string normTitle = normalizeTitle(movie.getTitle());
             titleIndex->remove(normTitle);
         }
         catch (...) {}
 
         movieIndex->remove(movieID);
+        commit();
+        catalog->remove(movieID);
+        movieStorage->freeSlot(slot);
     }
 
     vector<uint32_t> getAllMovieIDs() {
         vector<uint32_t> ids;
-        vector<pair<uint32_t, uint64_t>> pairs = movieIndex->getAllPairs();
-        for (const auto& p : pairs) {
-            ids.push_back(p.first);
+        for (auto it = movieIndex->begin(); it != movieIndex->end(); ++it) {
+            ids.push_back(it.key());
+        }
+        return ids;
+    }
+
+    vector<uint32_t> getMovieIDs(uint32_t fromID, size_t limit) {
+        vector<uint32_t> ids;
+        for (auto it = movieIndex->lowerBound(fromID); it != movieIndex->end() && ids.size() < limit; ++it) {
+            ids.push_back(it.key());
         }
         return ids;
     }
 
     vector<pair<uint32_t, uint64_t>> getMovieIndex() {
-        return movieIndex->getAllPairs();
+        vector<pair<uint32_t, uint64_t>> entries;
+        for (auto it = movieIndex->begin(); it != movieIndex->end(); ++it) {
+            entries.push_back(make_pair(it.key(), static_cast<uint64_t>(it.value())));
+        }
+        return entries;
+    }
+
+    const GenreDictionary& getGenreDictionary() const {
+        return *genres;
+    }
+
+    // Resident scoring fields of every movie; see MovieCatalog.
+    const MovieCatalog& getCatalog() const {
+        return *catalog;
     }
 
     size_t getMovieCount() {
         return movieIndex->size();
     }
+
+    uint64_t getIndexCacheHits() const {
+        return userIndex->getCacheHits() + movieIndex->getCacheHits();
+    }
+
+    uint64_t getIndexCacheMisses() const {
+        return userIndex->getCacheMisses() + movieIndex->getCacheMisses();
+    }
+
+    // Checkpoint: writes back every cached page, syncs the data files and
+    // drops the log segments they cover.
+    void flush() {
+        wal->checkpoint([this]() {
+            userIndex->flush();
+            movieIndex->flush();
+            userStorage->sync();
+            movieStorage->sync();
+        });
+    }
+
+    void compactIndices() {
+        userIndex->compact();
+        movieIndex->compact();
+    }
 };
 
 #endif
\ No newline at end of file
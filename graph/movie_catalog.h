@@ -0,0 +1,146 @@
+#ifndef MOVIE_CATALOG_H
+#define MOVIE_CATALOG_H
+
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include "../core/hash_table.h"
+#include "../core/types.h"
+#include "node.h"
+#include "genre_dictionary.h"
+
+using namespace std;
+
+// The fields scoring reads for one movie, copied out of the catalog.
+struct MovieStats {
+    uint32_t movieID;
+    uint32_t ratingCount;
+    uint32_t sumRating;
+    uint64_t genreMask;
+    uint32_t primaryGenre;
+
+    float getAvgRating() const {
+        if (ratingCount == 0) return 0.0f;
+        return (sumRating / 100.0f) / ratingCount;
+    }
+};
+
+// Resident copy of every movie's scoring fields, as parallel arrays
+// indexed by the movie's storage slot (slots are dense, see FixedStorage).
+// Genres are the record's GenreDictionary bitmask plus the ID of the
+// movie's first genre, so scoring a movie is a handful of array loads
+// with no disk read or allocation. GraphDatabase updates the catalog
+// wherever it writes a movie record.
+class MovieCatalog {
+private:
+    vector<uint32_t> movieIDs;
+    vector<uint32_t> ratingCounts;
+    vector<uint32_t> ratingSums;
+    vector<uint64_t> genreMasks;
+    vector<uint32_t> primaryGenres;
+
+    HashTable<uint32_t, uint32_t>* slots;
+    const GenreDictionary* genres;
+
+    mutable shared_mutex latch;
+
+    MovieStats statsAt(uint32_t slot) const {
+        MovieStats stats;
+        stats.movieID = movieIDs[slot];
+        stats.ratingCount = ratingCounts[slot];
+        stats.sumRating = ratingSums[slot];
+        stats.genreMask = genreMasks[slot];
+        stats.primaryGenre = primaryGenres[slot];
+        return stats;
+    }
+
+public:
+    static constexpr uint32_t NO_GENRE = GenreDictionary::NO_GENRE;
+
+    MovieCatalog(const GenreDictionary* dictionary) : genres(dictionary) {
+        slots = new HashTable<uint32_t, uint32_t>(HASH_TABLE_SIZE);
+    }
+
+    ~MovieCatalog() {
+        delete slots;
+    }
+
+    MovieCatalog(const MovieCatalog&) = delete;
+    MovieCatalog& operator=(const MovieCatalog&) = delete;
+
+    // Adds the movie stored at slot, or refreshes it. movie.genreMask must
+    // be set.
+    void put(uint32_t slot, const Movie& movie) {
+        uint32_t primary = NO_GENRE;
+        if (movie.getGenreCount() > 0) {
+            primary = genres->find(movie.getGenre(0));
+        }
+
+        unique_lock<shared_mutex> lock(latch);
+
+        if (slot >= movieIDs.size()) {
+            size_t size = slot + 1 > movieIDs.size() * 2 ? slot + 1 : movieIDs.size() * 2;
+            movieIDs.resize(size, 0);
+            ratingCounts.resize(size, 0);
+            ratingSums.resize(size, 0);
+            genreMasks.resize(size, 0);
+            primaryGenres.resize(size, NO_GENRE);
+        }
+
+        movieIDs[slot] = movie.movieID;
+        ratingCounts[slot] = movie.ratingCount;
+        ratingSums[slot] = movie.sumRating;
+        genreMasks[slot] = movie.genreMask;
+        primaryGenres[slot] = primary;
+        slots->insert(movie.movieID, slot);
+    }
+
+    void remove(uint32_t movieID) {
+        unique_lock<shared_mutex> lock(latch);
+
+        uint32_t slot;
+        if (!slots->find(movieID, slot)) {
+            return;
+        }
+        slots->remove(movieID);
+
+        movieIDs[slot] = 0;
+        ratingCounts[slot] = 0;
+        ratingSums[slot] = 0;
+        genreMasks[slot] = 0;
+        primaryGenres[slot] = NO_GENRE;
+    }
+
+    bool get(uint32_t movieID, MovieStats& stats) const {
+        shared_lock<shared_mutex> lock(latch);
+
+        uint32_t slot;
+        if (!slots->find(movieID, slot)) {
+            return false;
+        }
+        stats = statsAt(slot);
+        return true;
+    }
+
+    // Stats for each of movieIDs, in order, under one lock. Movies not in
+    // the catalog come back with movieID 0.
+    vector<MovieStats> getMany(const vector<uint32_t>& ids) const {
+        shared_lock<shared_mutex> lock(latch);
+
+        vector<MovieStats> result(ids.size(), MovieStats());
+        for (size_t i = 0; i < ids.size(); i++) {
+            uint32_t slot;
+            if (slots->find(ids[i], slot)) {
+                result[i] = statsAt(slot);
+            }
+        }
+        return result;
+    }
+
+    size_t getSize() const {
+        shared_lock<shared_mutex> lock(latch);
+        return slots->getSize();
+    }
+};
+
+#endif
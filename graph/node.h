@@ -2,6 +2,7 @@
 #define NODE_H
 
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <cstring>
 #include <vector>
@@ -88,15 +89,18 @@ struct Movie {
     uint32_t genreCount;
     uint32_t ratingCount;
     uint32_t sumRating;
-    uint64_t reserved;
+    // Bit i set = has the genre with GenreDictionary ID i. Set by
+    // GraphDatabase when it writes the record; 0 in records from before
+    // the dictionary existed.
+    uint64_t genreMask;
 
-    Movie() : movieID(0), genreCount(0), ratingCount(0), sumRating(0), reserved(0) {
+    Movie() : movieID(0), genreCount(0), ratingCount(0), sumRating(0), genreMask(0) {
         memset(title, 0, MAX_TITLE_LENGTH);
         memset(genres, 0, MAX_GENRES * MAX_GENRE_LENGTH);
     }
 
     Movie(uint32_t id, const string& t, const vector<string>& g)
-        : movieID(id), genreCount(0), ratingCount(0), sumRating(0), reserved(0) {
+        : movieID(id), genreCount(0), ratingCount(0), sumRating(0), genreMask(0) {
         memset(title, 0, MAX_TITLE_LENGTH);
         memset(genres, 0, MAX_GENRES * MAX_GENRE_LENGTH);
 
@@ -123,6 +127,15 @@ struct Movie {
         return result;
     }
 
+    uint32_t getGenreCount() const {
+        return genreCount < MAX_GENRES ? genreCount : static_cast<uint32_t>(MAX_GENRES);
+    }
+
+    // Points into the record, so it is only valid while the Movie is.
+    string_view getGenre(uint32_t i) const {
+        return string_view(genres[i], strnlen(genres[i], MAX_GENRE_LENGTH));
+    }
+
     void setGenres(const vector<string>& g) {
         genreCount = 0;
         for (size_t i = 0; i < g.size() && i < MAX_GENRES; i++) {
@@ -162,7 +175,7 @@ struct Movie {
         offset += sizeof(uint32_t);
         memcpy(buffer + offset, &sumRating, sizeof(uint32_t));
         offset += sizeof(uint32_t);
-        memcpy(buffer + offset, &reserved, sizeof(uint64_t));
+        memcpy(buffer + offset, &genreMask, sizeof(uint64_t));
     }
 
     static Movie deserialize(const char* buffer) {
@@ -180,7 +193,7 @@ struct Movie {
         offset += sizeof(uint32_t);
         memcpy(&node.sumRating, buffer + offset, sizeof(uint32_t));
         offset += sizeof(uint32_t);
-        memcpy(&node.reserved, buffer + offset, sizeof(uint64_t));
+        memcpy(&node.genreMask, buffer + offset, sizeof(uint64_t));
         return node;
     }
 
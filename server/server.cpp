@@ -22,10 +22,12 @@ RecommendationEngine* engine = nullptr;
 AuthManager* auth = nullptr;
 int serverSocket = -1;
 bool running = true;
-shared_mutex storageMutex;
 
-// Mutexes for thread safety
-mutex engineMutex;
+// Read handlers share storageMutex; anything that writes users, movies or
+// ratings takes it exclusively. The genre and title indices and the session
+// table are concurrent maps and need neither lock. authMutex serializes the
+// auth file.
+shared_mutex storageMutex;
 mutex authMutex;
 
 struct Message {
@@ -131,7 +133,7 @@ void handleLogin(Message& request, Message& response) {
         int userID = auth->login(username, password);
 
         {
-            lock_guard<mutex> engineLock(engineMutex);
+            unique_lock<shared_mutex> storageLock(storageMutex);
             if (!engine->userExists(userID)) {
                 engine->createUser(userID, username);
             }
@@ -166,7 +168,7 @@ void handleRegister(Message& request, Message& response) {
         int userID = auth->registerUser(username, password);
 
         {
-            lock_guard<mutex> engineLock(engineMutex);
+            unique_lock<shared_mutex> storageLock(storageMutex);
             if (!engine->userExists(userID)) {
                 engine->createUser(userID, username);
             }
@@ -185,7 +187,6 @@ void handleRegister(Message& request, Message& response) {
 
 void handleRecommendations(Message& request, Message& response) {
     shared_lock<shared_mutex> lock(storageMutex);
-    lock_guard<mutex> engineLock(engineMutex);
 
     try {
         int topN = 10;
@@ -220,7 +221,7 @@ void handleRecommendations(Message& request, Message& response) {
 }
 
 void handleColdStart(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
+    shared_lock<shared_mutex> lock(storageMutex);
 
     try {
         vector<RecommendationResult> recs = engine->getColdStartRecommendations();
@@ -248,7 +249,7 @@ void handleColdStart(Message& request, Message& response) {
 }
 
 void handleSearch(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
+    shared_lock<shared_mutex> lock(storageMutex);
 
     try {
         string query(request.data);
@@ -271,7 +272,7 @@ void handleSearch(Message& request, Message& response) {
 }
 
 void handleGetMovieDetails(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
+    shared_lock<shared_mutex> lock(storageMutex);
 
     try {
         string reqData(request.data);
@@ -294,7 +295,6 @@ void handleGetMovieDetails(Message& request, Message& response) {
 
 void handleAddRating(Message& request, Message& response) {
     unique_lock<shared_mutex> lock(storageMutex);
-    lock_guard<mutex> engineLock(engineMutex);
 
     try {
         string reqData(request.data);
@@ -319,7 +319,7 @@ void handleAddRating(Message& request, Message& response) {
 }
 
 void handleGetUserRatings(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
+    shared_lock<shared_mutex> lock(storageMutex);
 
     try {
         vector<RatingEdge> ratings = engine->getUserRatings(request.userID);
@@ -340,8 +340,6 @@ void handleGetUserRatings(Message& request, Message& response) {
 }
 
 void handleGetAllGenres(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
-
     try {
         vector<string> genres = engine->getAllGenres();
 
@@ -360,8 +358,6 @@ void handleGetAllGenres(Message& request, Message& response) {
 }
 
 void handleGetMoviesByGenre(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
-
     try {
         string genre(request.data);
         vector<uint32_t> movieIDs = engine->getMoviesByGenre(genre);
@@ -381,7 +377,7 @@ void handleGetMoviesByGenre(Message& request, Message& response) {
 }
 
 void handlePopular(Message& request, Message& response) {
-    lock_guard<mutex> lock(engineMutex);
+    shared_lock<shared_mutex> lock(storageMutex);
 
     try {
         int topN = 15;
@@ -435,7 +431,6 @@ void handleChangePassword(Message& request, Message& response) {
 }
 
 void handleLogout(Message& request, Message& response) {
-    lock_guard<mutex> lock(authMutex);
     auth->logout(request.userID);
     response.type = SUCCESS;
     copyToBuffer(response.data, "Logged out", sizeof(response.data));